@@ -6,12 +6,23 @@
  * Description: Simple DHCP server
  */
 #include "dserver.hpp"
+#include "sync.hpp"
+#include "replay.hpp"
 
 int socket_handle = -1; //global variable for socket
+volatile sig_atomic_t stop = 0;	//set by SIGINT handler
 
+int (*reply_hook)(dhcp_packet *packet, struct sockaddr_in *sa) = nullptr;
+time_t virtual_time = (time_t)-1;
+
+#ifndef DSERVER_NO_MAIN
 int main(int argc, char **argv)
 {
-	signal(SIGINT, handleSignal);
+	// no SA_RESTART, SIGINT interrupts recvfrom
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = handleSignal;
+	sigaction(SIGINT, &act, nullptr);
 
 	dhcp_packet packet;
 	addresses addr;
@@ -20,68 +31,37 @@ int main(int argc, char **argv)
 	struct sockaddr_in sa;
 	struct sockaddr_in client; // address of client
 	socklen_t length; // length of sockaddr_in client
-	vector<uint32_t> pool;
+	address_pool pool;
 	vector<uint32_t> excluded;
-	vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> lease;	//[(MAC, IP address, lease start, lease end), (...), ....]
+	vector<lease_t> lease;	//[(client, IP address, lease start, lease end), (...), ....]
 	uint32_t offered_address = (uint32_t)-1;
 	string filename;
+	sync_config sync_cfg;
+	replay_config replay_cfg;
 
 	// check arguments
+	if (check_sync_args(argc, argv, &sync_cfg) == 1 || check_replay_args(argc, argv, &replay_cfg) == 1
+		|| check_port_arg(argc, argv, &port) == 1) {
+		usage();
+		return EXIT_FAILURE;
+	}
 	if (check_args(argc, argv, &addr, excluded, filename) == 1)
 		return EXIT_FAILURE;
 
-	// open file with static allocations
-	if (!filename.empty())
-	{
-		ifstream infile(filename);
-		if (infile.good()) {
-			string mac;
-			string ip;
-			string delim(":");
-			array<u_char, 16> mac_arr;
-			while (infile >> mac >> ip) {
-				if (inet_addr(ip.c_str()) == (uint32_t)-1) {
-					cerr << "Error: Invalid IP address: " << ip << " in file: " << filename << endl;
-					return EXIT_FAILURE;
-				}
-				int cnt = 0;
-				mac_arr.fill(0);
-				size_t found = mac.find(delim);
-				while (found != string::npos && cnt < 6) {
-					mac_arr[cnt] = stoi(mac.substr(0, found), 0, 16);
-					mac = mac.erase(0, (found + delim.length()));
-					found = mac.find(delim);
-					cnt++;
-				}
-				mac_arr[cnt] = stoi(mac.substr(0), 0, 16);
+	// replay starts virtual clock before static allocations are loaded
+	if (!replay_cfg.input.empty() && replay_open(&replay_cfg) != 0)
+		return EXIT_FAILURE;
 
-				if (cnt != 5) {
-					cerr << "Error: Invalid MAC address in file: " << filename << endl;
-					return EXIT_FAILURE;
-				}
-				lease.emplace_back(mac_arr, inet_addr(ip.c_str()), time(nullptr), time(nullptr) + LEASE_100Y);
-				excluded.push_back(inet_addr(ip.c_str()));
-			}
-		}
-		else {
-			cerr << "Error: File not found" << endl;
-			usage();
-			return EXIT_FAILURE;
-		}
-	}
+	// open file with static allocations
+	if (!filename.empty() && load_static(filename, lease, excluded) != 0)
+		return EXIT_FAILURE;
 
 	get_addresses(&addr);
+	init_pool(&addr, excluded, pool);
 
-	//initialize address pool
-	for (uint32_t i = addr.first; i <= addr.last; i += htonl(1)) {
-		pool.push_back(i);
-	}
-
-	//delete first address (server address) and excluded addresses from pool
-	pool.erase(pool.begin());
-	for (auto i = excluded.begin(); i != excluded.end(); ++i) {
-		pool.erase(remove(pool.begin(), pool.end(), *i), pool.end());
-	}
+	// process captured traffic instead of network
+	if (!replay_cfg.input.empty())
+		return replay_run(&replay_cfg, &addr, pool, lease) == 0 ? 0 : EXIT_FAILURE;
 
 	// create UDP socket
 	if ((socket_handle = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
@@ -102,69 +82,317 @@ int main(int argc, char **argv)
 	}
 	length = sizeof(client);
 
-	while((rcBytes = recvfrom(socket_handle, &packet, sizeof(packet), 0, (struct sockaddr*)&client, &length)) >= 0) {
-		del_expired(pool, lease); //delete expired leases
-		int message_type = get_message_type(&packet);
+	if (sync_start(&sync_cfg) != 0)
+		return EXIT_FAILURE;
+	if (sync_cfg.role != SYNC_NONE) {
+		// wake up periodically to apply updates from peer
+		struct timeval tv = {0, SYNC_POLL_MS * 1000};
+		setsockopt(socket_handle, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
 
-		if (message_type == DHCPDISCOVER) {
-			if ((offered_address = offer(socket_handle, &packet, &addr, pool, lease)) == 1)
-				cerr << "ERR: Failed to offer" << endl;
+	while (!stop) {
+		rcBytes = recvfrom(socket_handle, &packet, sizeof(packet), 0, (struct sockaddr*)&client, &length);
+		sync_apply(pool, lease); //apply lease changes from primary
+		if (rcBytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+			break;
 		}
-		else if (message_type == DHCPREQUEST) {
-			//check request && send ACK/NAK
-			uint32_t req_addr = 0;
-			// SELECTING state
-			if (check_ip_addr(&packet, addr.first, OPT_SERVER_ID) == 0
-				&& check_ip_addr(&packet, offered_address, OPT_REQ_IP) == 0
-				&& packet.ciaddr == 0) {
-				if (ack(socket_handle, &packet, offered_address, &addr, pool, lease) != 0)
-					cerr << "ERR: Failed to ack" << endl;
-			}
-			// INIT-REBOOT state
-			else if (check_ip_addr(&packet, addr.first, OPT_SERVER_ID) == 2
-				&& packet.ciaddr == 0) {
-				check_ip_addr(&packet, req_addr, OPT_REQ_IP, &req_addr);
-				if (packet.giaddr == 0) {
-					if (ntohl(req_addr) < ntohl(addr.first) || ntohl(req_addr) > ntohl(addr.last)) {
-						// ip address is not from my pool -> send DHCPNAK
-						if (nak(socket_handle, &packet, &addr) != 0)
-							cerr << "Err: Failed to send DHCPNAK" << endl;
+		if (sync_passive()) //primary is alive, standby stays silent
+			continue;
+		handle_packet(socket_handle, &packet, rcBytes, &addr, pool, lease, &offered_address);
+		pool_prepare(pool);	//pick addresses for next clients while waiting for packet
+	}
+	close(socket_handle);
+	sync_report(cerr);
+	cout.flush();
+	_exit(stop ? SIGINT : 0);	//detached sync threads still use its statics, skip their destructors
+}
+#endif
+
+int handle_packet(int socket_handle, dhcp_packet *packet, int length, addresses *addr, address_pool &pool, vector<lease_t> &lease, uint32_t *offered_address)
+{
+	// drop truncated and non-DHCP packets, clear rest of buffer so options end inside received data
+	if (length < DHCP_MIN_LENGTH || length > (int)sizeof(dhcp_packet)
+		|| packet->op != BOOTPREQUEST || memcmp(packet->options, MAGIC_COOKIE, 4) != 0)
+		return -1;
+	memset((u_char *)packet + length, 0, sizeof(dhcp_packet) - length);
+
+	del_expired(pool, lease); //delete expired leases
+	int message_type = get_message_type(packet);
+
+	if (message_type == DHCPDISCOVER) {
+		release_offer(pool, lease, *offered_address);
+		if ((*offered_address = offer(socket_handle, packet, addr, pool, lease)) == 1) {
+			cerr << "ERR: Failed to offer" << endl;
+			*offered_address = (uint32_t)-1;
+		}
+	}
+	else if (message_type == DHCPREQUEST) {
+		//check request && send ACK/NAK
+		uint32_t req_addr = 0;
+		// SELECTING state
+		if (check_ip_addr(packet, addr->first, OPT_SERVER_ID) == 0
+			&& check_ip_addr(packet, *offered_address, OPT_REQ_IP) == 0
+			&& packet->ciaddr == 0) {
+			if (ack_or_nak(socket_handle, packet, *offered_address, *offered_address, addr, pool, lease) != 0)
+				cerr << "ERR: Failed to ack" << endl;
+		}
+		// INIT-REBOOT state
+		else if (check_ip_addr(packet, addr->first, OPT_SERVER_ID) == 2
+			&& packet->ciaddr == 0) {
+			check_ip_addr(packet, req_addr, OPT_REQ_IP, &req_addr);
+			if (packet->giaddr == 0) {
+				int i = 0;
+				if (ntohl(req_addr) < ntohl(addr->first) || ntohl(req_addr) > ntohl(addr->last)) {
+					// ip address is not from my pool -> send DHCPNAK
+					if (nak(socket_handle, packet, addr) != 0)
+						cerr << "Err: Failed to send DHCPNAK" << endl;
+				}
+				else if ((i = find_by_client(lease, packet)) != -1) {
+					// check that it requests address same as in lease
+					if (get<1>(lease[i]) == req_addr) {
+						if (ack_or_nak(socket_handle, packet, req_addr, *offered_address, addr, pool, lease) != 0)
+							cerr << "ERR: Failed to ack" << endl;
 					}
-					int i = 0;
-					if ((i = find_by_mac(lease, packet.chaddr)) != -1) {
-						// check that it requests address same as in lease
-						if (get<1>(lease[i]) == req_addr) {
-							if (ack(socket_handle, &packet, req_addr, &addr, pool, lease) != 0)
-								cerr << "ERR: Failed to ack" << endl;
-						}
-						else {
-							if (nak(socket_handle, &packet, &addr) != 0)
-								cerr << "Err: Failed to send DHCPNAK" << endl;
-						}
+					else {
+						if (nak(socket_handle, packet, addr) != 0)
+							cerr << "Err: Failed to send DHCPNAK" << endl;
 					}
-					// address not in leases -> do nothing, be silent
 				}
-				else if (ack(socket_handle, &packet, req_addr, &addr, pool, lease) != 0)
-					cerr << "ERR: Failed to ack" << endl;
-					
+				// address not in leases -> do nothing, be silent
 			}
-			// RENEWING/REBINDING state
-			else if (check_ip_addr(&packet, addr.first, OPT_SERVER_ID) == 2 
-				&& check_ip_addr(&packet, req_addr, OPT_SERVER_ID) == 2
-				&& packet.ciaddr != 0) {
-				if (ack(socket_handle, &packet, packet.ciaddr, &addr, pool, lease) != 0)
-					cerr << "ERR: Failed to ack" << endl;
-			}			
-			offered_address = (uint32_t)-1;
+			else if (ack_or_nak(socket_handle, packet, req_addr, *offered_address, addr, pool, lease) != 0)
+				cerr << "ERR: Failed to ack" << endl;
+
 		}
-		else if (message_type == DHCPRELEASE) {
-			del_by_mac(lease, pool, &packet, DHCPRELEASE);
+		// RENEWING/REBINDING state
+		else if (check_ip_addr(packet, addr->first, OPT_SERVER_ID) == 2
+			&& check_ip_addr(packet, req_addr, OPT_SERVER_ID) == 2
+			&& packet->ciaddr != 0) {
+			if (ack_or_nak(socket_handle, packet, packet->ciaddr, *offered_address, addr, pool, lease) != 0)
+				cerr << "ERR: Failed to ack" << endl;
 		}
+		release_offer(pool, lease, *offered_address);
+		*offered_address = (uint32_t)-1;
+	}
+	else if (message_type == DHCPRELEASE) {
+		del_by_client(lease, pool, packet, (uint32_t)-1);
+	}
+	return message_type;
+}
+
+int load_static(string &filename, vector<lease_t> &lease, vector<uint32_t> &excluded)
+{
+	ifstream infile(filename);
+	if (infile.good()) {
+		string mac;
+		string ip;
+		string delim(":");
+		array<u_char, 16> mac_arr;
+		while (infile >> mac >> ip) {
+			if (inet_addr(ip.c_str()) == (uint32_t)-1) {
+				cerr << "Error: Invalid IP address: " << ip << " in file: " << filename << endl;
+				return 1;
+			}
+			int cnt = 0;
+			mac_arr.fill(0);
+			size_t found = mac.find(delim);
+			while (found != string::npos && cnt < 6) {
+				mac_arr[cnt] = stoi(mac.substr(0, found), 0, 16);
+				mac = mac.erase(0, (found + delim.length()));
+				found = mac.find(delim);
+				cnt++;
+			}
+			mac_arr[cnt] = stoi(mac.substr(0), 0, 16);
+
+			if (cnt != 5) {
+				cerr << "Error: Invalid MAC address in file: " << filename << endl;
+				return 1;
+			}
+			u_char id[17] = {0};
+			memcpy(id + 1, mac_arr.data(), 16);
+			lease.emplace_back(make_key(id, sizeof(id)), inet_addr(ip.c_str()), get_time(), get_time() + LEASE_10Y);
+			excluded.push_back(inet_addr(ip.c_str()));
+		}
+	}
+	else {
+		cerr << "Error: File not found" << endl;
+		usage();
+		return 1;
 	}
 	return 0;
 }
 
-uint32_t offer(int socket_handle, dhcp_packet *disc_packet, addresses *addr, vector<uint32_t> &pool,  vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease)
+void init_pool(addresses *addr, vector<uint32_t> &excluded, address_pool &pool)
+{
+	//initialize address pool, first address is server address
+	uint32_t size = ntohl(addr->last) - ntohl(addr->first);
+	pool.first = ntohl(addr->first) + 1;
+	pool.count = 0;
+	pool.head = POOL_NONE;
+	pool.tail = POOL_NONE;
+	pool.prev.assign(size, POOL_NONE);
+	pool.next.assign(size, POOL_NONE);
+	pool.is_free.assign(size, 0);
+	pool.owner.assign(size, nullptr);
+	pool.ghost.clear();
+	pool.ghost_head = POOL_NONE;
+	pool.ghost_tail = POOL_NONE;
+	pool.ghost_prev.assign(size, POOL_NONE);
+	pool.ghost_next.assign(size, POOL_NONE);
+	pool.candidates.clear();
+
+	//never used addresses in ascending order, without excluded addresses
+	vector<char> is_excluded(size, 0);
+	for (auto i = excluded.begin(); i != excluded.end(); ++i) {
+		uint32_t off = ntohl(*i) - pool.first;
+		if (off < size)
+			is_excluded[off] = 1;
+	}
+	for (uint32_t off = 0; off < size; ++off) {
+		if (!is_excluded[off])
+			pool_add(pool, htonl(pool.first + off));
+	}
+	pool_prepare(pool);
+}
+
+// free address lost its ghost binding or was released without one
+// new clients must get it before ghost addresses, other candidates are refilled between packets
+static void add_candidate(address_pool &pool, uint32_t off)
+{
+	auto c = find(pool.candidates.begin(), pool.candidates.end(), off);
+	bool was_candidate = c != pool.candidates.end();
+	if (was_candidate)
+		pool.candidates.erase(c);
+	auto owned = find_if(pool.candidates.begin(), pool.candidates.end(), [&](uint32_t o) {
+		return pool.owner[o] != nullptr;
+	});
+	if (!was_candidate && owned == pool.candidates.end())
+		return;
+	pool.candidates.insert(owned, off);
+	if (pool.candidates.size() > POOL_CANDIDATES)
+		pool.candidates.pop_back();
+}
+
+// drop ghost binding of address
+static void forget_ghost(address_pool &pool, uint32_t off)
+{
+	const string *client = pool.owner[off];
+	if (client == nullptr)
+		return;
+	pool.ghost.erase(client);
+	pool.owner[off] = nullptr;
+	if (pool.ghost_prev[off] != POOL_NONE)
+		pool.ghost_next[pool.ghost_prev[off]] = pool.ghost_next[off];
+	else
+		pool.ghost_head = pool.ghost_next[off];
+	if (pool.ghost_next[off] != POOL_NONE)
+		pool.ghost_prev[pool.ghost_next[off]] = pool.ghost_prev[off];
+	else
+		pool.ghost_tail = pool.ghost_prev[off];
+	free_key(client);
+	if (pool.is_free[off])
+		add_candidate(pool, off);
+}
+
+void pool_add(address_pool &pool, uint32_t address, const string *client /*=nullptr*/)
+{
+	uint32_t off = ntohl(address) - pool.first;
+	if (off >= pool.is_free.size() || pool.is_free[off])
+		return;
+	// append to free list
+	pool.is_free[off] = 1;
+	pool.prev[off] = pool.tail;
+	pool.next[off] = POOL_NONE;
+	if (pool.tail != POOL_NONE)
+		pool.next[pool.tail] = off;
+	else
+		pool.head = off;
+	pool.tail = off;
+	pool.count++;
+
+	if (client != nullptr) {
+		// remember binding for returning client, forget the oldest one
+		hold_key(client);	//before old ghost drops its reference
+		auto g = pool.ghost.find(client);
+		if (g != pool.ghost.end())
+			forget_ghost(pool, g->second);
+		pool.ghost[client] = off;
+		pool.owner[off] = client;
+		pool.ghost_prev[off] = pool.ghost_tail;
+		pool.ghost_next[off] = POOL_NONE;
+		if (pool.ghost_tail != POOL_NONE)
+			pool.ghost_next[pool.ghost_tail] = off;
+		else
+			pool.ghost_head = off;
+		pool.ghost_tail = off;
+		if (pool.ghost.size() > GHOST_SIZE)
+			forget_ghost(pool, pool.ghost_head);
+	}
+	else
+		add_candidate(pool, off);
+}
+
+void pool_take(address_pool &pool, uint32_t address)
+{
+	uint32_t off = ntohl(address) - pool.first;
+	if (off >= pool.is_free.size() || !pool.is_free[off])
+		return;
+	pool.is_free[off] = 0;
+	if (pool.prev[off] != POOL_NONE)
+		pool.next[pool.prev[off]] = pool.next[off];
+	else
+		pool.head = pool.next[off];
+	if (pool.next[off] != POOL_NONE)
+		pool.prev[pool.next[off]] = pool.prev[off];
+	else
+		pool.tail = pool.prev[off];
+	pool.count--;
+	forget_ghost(pool, off);
+	pool.candidates.erase(remove(pool.candidates.begin(), pool.candidates.end(), off), pool.candidates.end());
+}
+
+bool pool_contains(address_pool &pool, uint32_t address)
+{
+	uint32_t off = ntohl(address) - pool.first;
+	return off < pool.is_free.size() && pool.is_free[off];
+}
+
+uint32_t pool_pick(address_pool &pool, const client_key &key)
+{
+	auto g = pool.ghost.find(key.id);
+	if (g != pool.ghost.end())
+		return htonl(pool.first + g->second);	//returning client, ghost addresses are always free
+	if (pool.candidates.empty())
+		return POOL_NONE;
+	return htonl(pool.first + pool.candidates.front());
+}
+
+void pool_prepare(address_pool &pool)
+{
+	if (pool.candidates.size() >= POOL_CANDIDATES || pool.candidates.size() == pool.count)
+		return;
+	// least recently used addresses first, keep ghost addresses for their clients while possible
+	// ghost addresses are picked only if no other address is free, add_candidate puts later freed ones before them
+	for (int pass = 0; pass < 2 && pool.candidates.size() < POOL_CANDIDATES; ++pass) {
+		for (uint32_t off = pool.head; off != POOL_NONE && pool.candidates.size() < POOL_CANDIDATES; off = pool.next[off]) {
+			if ((pass == 0) == (pool.owner[off] == nullptr)
+				&& find(pool.candidates.begin(), pool.candidates.end(), off) == pool.candidates.end())
+				pool.candidates.push_back(off);
+		}
+	}
+}
+
+vector<uint32_t> pool_list(address_pool &pool)
+{
+	vector<uint32_t> list;
+	for (uint32_t off = pool.head; off != POOL_NONE; off = pool.next[off])
+		list.push_back(htonl(pool.first + off));
+	return list;
+}
+
+uint32_t offer(int socket_handle, dhcp_packet *disc_packet, addresses *addr, address_pool &pool, vector<lease_t> &lease)
 {
 	int err;
 	struct sockaddr_in sa;
@@ -172,10 +400,10 @@ uint32_t offer(int socket_handle, dhcp_packet *disc_packet, addresses *addr, vec
 	dhcp_packet offer_packet;
 	uint32_t addr1;
 	int i = -1;
-	if ((i = find_by_mac(lease, disc_packet->chaddr)) != -1) {
+	if ((i = find_by_client(lease, disc_packet)) != -1) {
 		addr1 = get<1>(lease[i]);  //offering previously allocated address
 	}
-	else if (pool.size() < 1) {
+	else if ((addr1 = pool_pick(pool, get_client_key(disc_packet))) == POOL_NONE) {
 		cerr << "Warning: Address pool is empty" << endl;
 		return 1;
 	}
@@ -199,9 +427,6 @@ uint32_t offer(int socket_handle, dhcp_packet *disc_packet, addresses *addr, vec
 		sa.sin_addr.s_addr = addr->broadcast;
 	}
 
-	//set socket to broadcast
-	setsockopt(socket_handle,SOL_SOCKET,SO_BROADCAST,&on,sizeof(on));
-
 	//set dhcp packet options
 	offer_packet.op = BOOTPREPLY;
 	offer_packet.htype = disc_packet->htype;
@@ -209,10 +434,8 @@ uint32_t offer(int socket_handle, dhcp_packet *disc_packet, addresses *addr, vec
 	offer_packet.xid = disc_packet->xid;
 	offer_packet.flags = disc_packet->flags;
 	
-	if (i < 0) {
-		addr1 = pool.front();	//give client first address of pool
-		pool.erase(pool.begin());	//delete first address from pool	
-	}
+	if (i < 0)
+		pool_take(pool, addr1);	//delete picked address from pool
 	uint32_t addr2 = addr->first;
 	memcpy(&offer_packet.yiaddr, &addr1, 4);
 	memcpy(&offer_packet.siaddr, &addr2, 4);
@@ -246,14 +469,14 @@ uint32_t offer(int socket_handle, dhcp_packet *disc_packet, addresses *addr, vec
 	//end
 	offer_packet.options[25] = 255;
 
-	if ((err = sendto(socket_handle, &offer_packet, sizeof(offer_packet), 0, (struct sockaddr*)&sa, sizeof(sa))) < 0) {	
+	if ((err = send_packet(socket_handle, &offer_packet, &sa, on)) < 0) {	
 		cerr << "Error: sendto in offer: " << err << endl;
 		return 1;
 	}
 	return addr1; //return offered address
 }
 
-int ack(int socket_handle, dhcp_packet *packet, uint32_t offered_address, addresses *addr, vector<uint32_t> &pool, vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease)
+int ack(int socket_handle, dhcp_packet *packet, uint32_t offered_address, addresses *addr, address_pool &pool, vector<lease_t> &lease)
 {
 	int err;
 	struct sockaddr_in sa;
@@ -280,9 +503,6 @@ int ack(int socket_handle, dhcp_packet *packet, uint32_t offered_address, addres
 		sa.sin_addr.s_addr = addr->broadcast;
 	}
 
-	//set socket to broadcast
-	setsockopt(socket_handle,SOL_SOCKET,SO_BROADCAST,&on,sizeof(on));
-
 	//set dhcp packet options
 	ack_packet.op = BOOTPREPLY;
 	ack_packet.htype = packet->htype;
@@ -323,59 +543,70 @@ int ack(int socket_handle, dhcp_packet *packet, uint32_t offered_address, addres
 	//end
 	ack_packet.options[25] = 255;
 
-	if ((err = sendto(socket_handle, &ack_packet, sizeof(ack_packet), 0, (struct sockaddr*)&sa, sizeof(sa))) < 0) {	
+	if ((err = send_packet(socket_handle, &ack_packet, &sa, on)) < 0) {	
 		cerr << "Error: sendto in ack: " << err << endl;
 		return 1;
 	}
 
 	//update lease vector of tuples
-	char buff_start[26];
-	char buff_end[26];
 	// get timestamps of start and end of lease
-	time_t t_start = time(nullptr);
-	time_t t_end = time(nullptr) + LEASE_TIME;
+	time_t t_start = get_time();
+	time_t t_end = get_time() + LEASE_TIME;
 	array<u_char, 16> client_mac;
 	//transform HW address of client from u_char* to array<u_char>
 	memcpy(client_mac.data(), ack_packet.chaddr, 16);
 
-	if (del_by_mac(lease, pool, &ack_packet, DHCPACK) != 1){
-		// emplace lease info to vector
-		lease.emplace_back(client_mac, offered_address, t_start, t_end);
+	if (del_by_client(lease, pool, packet, offered_address) != 1){
+		// emplace lease info to vector, lease holds interned client key
+		client_key key = get_client_key(packet, true);
+		lease.emplace_back(key, offered_address, t_start, t_end);
+		pool_take(pool, offered_address);
+		sync_lease(SYNC_ADD, key, offered_address, t_start, t_end);
 
-		client_mac.fill(0);
 		// print table of leases
-		auto row = lease.back();
-		client_mac = get<0>(row);
-		for (int i = 0; i < 5; ++i)
-			cout << hex << +client_mac[i] << ":";
-		ctime_r(&get<2>(row), buff_start);	//get c string from timestamp
-		ctime_r(&get<3>(row), buff_end);
-		string start(buff_start);	// get string from c string
-		string end(buff_end);
-		start.erase(start.find('\n', 0), 1);	// delete trailing \n
-		end.erase(end.find('\n', 0), 1);
-		cout << hex << +client_mac[5] << dec << " " << inet_ntoa(*(struct in_addr *)&get<1>(row)) << " " << start << " " << end << endl;
+		print_lease(client_mac, offered_address, t_start, t_end);
 	}
 	else { //if there is statically allocated address
 		int i = -1;
-		if ((i = find_by_mac(lease, ack_packet.chaddr)) != -1) {
+		if ((i = find_by_client(lease, packet)) != -1) {
 			addr1 = get<1>(lease[i]);
-			client_mac.fill(0);
-			client_mac = get<0>(lease[i]);
-			ctime_r(&get<2>(lease[i]), buff_start);	//get c string from timestamp
-			ctime_r(&t_end, buff_end);
-			string start(buff_start);	// get string from c string
-			string end(buff_end);
-			start.erase(start.find('\n', 0), 1);	// delete trailing \n
-			end.erase(end.find('\n', 0), 1);
-			for (int j = 0; j < 5; ++j)
-				cout << hex << +client_mac[j] << ":";
-			cout << hex << +client_mac[5] << dec << " " << inet_ntoa(*(struct in_addr *)&get<1>(lease[i])) << " " << start << " " << end << endl;
+			print_lease(client_mac, get<1>(lease[i]), get<2>(lease[i]), t_end);
 		}
 	}
 	return 0;
 }
 
+void print_lease(array<u_char, 16> &client_mac, uint32_t address, time_t t_start, time_t t_end)
+{
+	char buff_start[26];
+	char buff_end[26];
+	ctime_r(&t_start, buff_start);	//get c string from timestamp
+	ctime_r(&t_end, buff_end);
+	string start(buff_start);	// get string from c string
+	string end(buff_end);
+	start.erase(start.find('\n', 0), 1);	// delete trailing \n
+	end.erase(end.find('\n', 0), 1);
+	for (int i = 0; i < 5; ++i)
+		cout << hex << +client_mac[i] << ":";
+	cout << hex << +client_mac[5] << dec << " " << inet_ntoa(*(struct in_addr *)&address) << " " << start << " " << end << endl;
+}
+
+int ack_or_nak(int socket_handle, dhcp_packet *packet, uint32_t address, uint32_t offered_address, addresses *addr, address_pool &pool, vector<lease_t> &lease)
+{
+	// client may get its own lease, address offered to it or a free address
+	int i = find_by_client(lease, packet);
+	if (i != -1 && get<1>(lease[i]) == address)
+		return ack(socket_handle, packet, address, addr, pool, lease);
+	for (auto j = lease.begin(); j != lease.end(); ++j) {
+		if (get<1>(*j) == address)	// leased to other client
+			return nak(socket_handle, packet, addr);
+	}
+	bool is_free = address != (uint32_t)-1 && (address == offered_address || pool_contains(pool, address));
+	if (is_free && (i == -1 || !is_static(lease[i])))
+		return ack(socket_handle, packet, address, addr, pool, lease);
+	return nak(socket_handle, packet, addr);
+}
+
 int nak(int socket_handle, dhcp_packet *packet, addresses *addr)
 {
 	int err;
@@ -392,7 +623,6 @@ int nak(int socket_handle, dhcp_packet *packet, addresses *addr)
 	on = 1;
 	sa.sin_addr.s_addr = addr->broadcast;
 	// sa.sin_addr.s_addr = INADDR_BROADCAST;
-	setsockopt(socket_handle,SOL_SOCKET,SO_BROADCAST,&on,sizeof(on));
 
 	//set dhcp packet options
 	nak_packet.op = BOOTPREPLY;
@@ -421,13 +651,29 @@ int nak(int socket_handle, dhcp_packet *packet, addresses *addr)
 	//end
 	nak_packet.options[13] = 255;
 
-	if ((err = sendto(socket_handle, &nak_packet, sizeof(nak_packet), 0, (struct sockaddr*)&sa, sizeof(sa))) < 0) {	
+	if ((err = send_packet(socket_handle, &nak_packet, &sa, on)) < 0) {	
 		cerr << "Error: sendto in nack: " << err << endl;
 		return 1;
 	}
 	return 0; //return offered address
 }
 
+time_t get_time()
+{
+	if (virtual_time != (time_t)-1)
+		return virtual_time;
+	return time(nullptr);
+}
+
+int send_packet(int socket_handle, dhcp_packet *packet, struct sockaddr_in *sa, int on)
+{
+	if (reply_hook != nullptr)
+		return reply_hook(packet, sa);
+	//set socket to broadcast
+	setsockopt(socket_handle,SOL_SOCKET,SO_BROADCAST,&on,sizeof(on));
+	return sendto(socket_handle, packet, sizeof(dhcp_packet), 0, (struct sockaddr*)sa, sizeof(*sa));
+}
+
 //transform int to bytes
 //inspired by http://stackoverflow.com/questions/5585532/c-int-to-byte-array
 vector<unsigned char> itob(size_t number, int bytes)
@@ -438,36 +684,40 @@ vector<unsigned char> itob(size_t number, int bytes)
 	return v;
 }
 
-void del_expired(vector<uint32_t> &pool, vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease)
+void del_expired(address_pool &pool, vector<lease_t> &lease)
 {
-	time_t now = time(nullptr);
-	vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> to_delete;
+	time_t now = get_time();
+	vector<lease_t> to_delete;
 	to_delete.clear();
 	for (auto i = lease.begin(); i != lease.end(); ++i) {
 		if (now > get<3>(*i)) {
 			to_delete.push_back(*i);
-			pool.push_back(get<1>(*i));
+			pool_add(pool, get<1>(*i), get<0>(*i).id);
+			sync_lease(SYNC_DEL, get<0>(*i), get<1>(*i), get<2>(*i), get<3>(*i));
 		}
 	}
 	// delete all lines marked for deletion
-	for (auto i = to_delete.begin(); i != to_delete.end(); ++i)
+	for (auto i = to_delete.begin(); i != to_delete.end(); ++i) {
 		lease.erase(remove(lease.begin(), lease.end(), *i), lease.end());
+		free_key(get<0>(*i).id);
+	}
 }
 
-int del_by_mac(vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease, vector<uint32_t> &pool, dhcp_packet *packet, int message_type)
+int del_by_client(vector<lease_t> &lease, address_pool &pool, dhcp_packet *packet, uint32_t keep_addr)
 {
-	array<u_char, 16> chaddr_arr;
-	vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> to_delete;
+	client_key key = get_client_key(packet);
+	client_key hw_key = get_hw_key(packet);
+	vector<lease_t> to_delete;
 	to_delete.clear();
-	memcpy(&chaddr_arr, &packet->chaddr, 16);
 	for (auto i = lease.begin(); i != lease.end(); ++i) {
-		if (chaddr_arr == get<0>(*i)) {
+		if (key == get<0>(*i) || hw_key == get<0>(*i)) {
 			uint32_t addr = get<1>(*i);
-			if (get<3>(*i) < (time(nullptr) + LEASE_TIME)) { //address is not statically allocated
-				if (message_type == DHCPRELEASE || packet->yiaddr != addr) {
-					pool.push_back(addr);
+			if (!is_static(*i)) {
+				if (addr != keep_addr) {
+					pool_add(pool, addr, get<0>(*i).id);
 				}
 				to_delete.push_back(*i);
+				sync_lease(SYNC_DEL, get<0>(*i), addr, get<2>(*i), get<3>(*i));
 			}
 			else
 				return 1; //address is statically allocated - do not delete
@@ -476,34 +726,255 @@ int del_by_mac(vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease
 	// delete all lines marked for deletion
 	for (auto i = to_delete.begin(); i != to_delete.end(); ++i) {
 		lease.erase(remove(lease.begin(), lease.end(), *i), lease.end());
+		free_key(get<0>(*i).id);
 	}
 	return 0;
 }
 
-int find_by_mac(vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease, u_char *mac)
+void release_offer(address_pool &pool, vector<lease_t> &lease, uint32_t offered_address)
 {
-	array<u_char, 16> chaddr_arr;
-	memcpy(&chaddr_arr, mac, 16);
+	if (offered_address == (uint32_t)-1 || pool_contains(pool, offered_address))
+		return;
 	for (auto i = lease.begin(); i != lease.end(); ++i) {
-		if (chaddr_arr == get<0>(*i)) {
+		if (get<1>(*i) == offered_address)
+			return;	// client took it
+	}
+	pool_add(pool, offered_address);
+}
+
+bool is_static(const lease_t &l)
+{
+	return get<3>(l) - get<2>(l) > LEASE_TIME;
+}
+
+int check_leases(addresses *addr, address_pool &pool, vector<lease_t> &lease, vector<uint32_t> &excluded, uint32_t offered_address)
+{
+	vector<uint32_t> pool_free = pool_list(pool);
+	vector<uint32_t> pool_sorted(pool_free);
+	vector<uint32_t> leased;
+	vector<const string *> clients;
+	vector<uint32_t> used(excluded);	// addresses that are not free
+	uint32_t first = ntohl(addr->first) + 1;	// first address is server
+	uint32_t last = ntohl(addr->last);
+
+	sort(pool_sorted.begin(), pool_sorted.end());
+	if (adjacent_find(pool_sorted.begin(), pool_sorted.end()) != pool_sorted.end()) {
+		cerr << "Invariant: duplicate address in pool" << endl;
+		return 1;
+	}
+	if (pool_free.size() != pool.count) {
+		cerr << "Invariant: pool count " << pool.count << " != free list " << pool_free.size() << endl;
+		return 1;
+	}
+	for (auto i = pool_free.begin(); i != pool_free.end(); ++i) {
+		if (ntohl(*i) < first || ntohl(*i) > last) {
+			cerr << "Invariant: pool address out of range " << inet_ntoa(*(struct in_addr *)&*i) << endl;
+			return 1;
+		}
+	}
+	for (auto i = pool.candidates.begin(); i != pool.candidates.end(); ++i) {
+		if (!pool.is_free[*i]) {
+			cerr << "Invariant: candidate address not free" << endl;
+			return 1;
+		}
+	}
+	for (auto i = pool.ghost.begin(); i != pool.ghost.end(); ++i) {
+		if (!pool.is_free[i->second] || pool.owner[i->second] != i->first) {
+			cerr << "Invariant: ghost address not free" << endl;
+			return 1;
+		}
+	}
+	if (pool.ghost.size() > GHOST_SIZE) {
+		cerr << "Invariant: ghost cache over " << GHOST_SIZE << endl;
+		return 1;
+	}
+	size_t ghosts = 0;
+	for (uint32_t off = pool.ghost_head; off != POOL_NONE && ghosts <= pool.ghost.size(); off = pool.ghost_next[off]) {
+		auto g = pool.ghost.find(pool.owner[off]);
+		if (g == pool.ghost.end() || g->second != off) {
+			cerr << "Invariant: stale ghost in eviction order" << endl;
+			return 1;
+		}
+		ghosts++;
+	}
+	if (ghosts != pool.ghost.size()) {
+		cerr << "Invariant: ghost eviction order " << ghosts << " != ghosts " << pool.ghost.size() << endl;
+		return 1;
+	}
+	if (adjacent_find(pool.candidates.begin(), pool.candidates.end(), [&](uint32_t a, uint32_t b) {
+			return pool.owner[a] != nullptr && pool.owner[b] == nullptr;
+		}) != pool.candidates.end()) {
+		cerr << "Invariant: ghost address candidate before free one" << endl;
+		return 1;
+	}
+	if (!pool.candidates.empty() && pool.owner[pool.candidates.front()] != nullptr && pool.count > pool.ghost.size()) {
+		cerr << "Invariant: new client would get ghost address while other is free" << endl;
+		return 1;
+	}
+	for (auto i = lease.begin(); i != lease.end(); ++i) {
+		leased.push_back(get<1>(*i));
+		clients.push_back(get<0>(*i).id);
+		if (binary_search(pool_sorted.begin(), pool_sorted.end(), get<1>(*i))) {
+			cerr << "Invariant: leased address in pool " << inet_ntoa(*(struct in_addr *)&get<1>(*i)) << endl;
+			return 1;
+		}
+	}
+	sort(leased.begin(), leased.end());
+	sort(clients.begin(), clients.end());
+	if (adjacent_find(leased.begin(), leased.end()) != leased.end()) {
+		cerr << "Invariant: address leased twice" << endl;
+		return 1;
+	}
+	if (adjacent_find(clients.begin(), clients.end()) != clients.end()) {
+		cerr << "Invariant: client has two leases" << endl;
+		return 1;
+	}
+
+	// pool + leases (+ excluded, outstanding offer) = range
+	used.insert(used.end(), leased.begin(), leased.end());
+	used.push_back(offered_address);
+	used.erase(remove_if(used.begin(), used.end(), [&](uint32_t a) {
+		return ntohl(a) < first || ntohl(a) > last || binary_search(pool_sorted.begin(), pool_sorted.end(), a);
+	}), used.end());
+	sort(used.begin(), used.end());
+	used.erase(unique(used.begin(), used.end()), used.end());
+	if (pool.count + used.size() != last - first + 1) {
+		cerr << "Invariant: pool " << pool.count << " + used " << used.size() << " != range " << last - first + 1 << endl;
+		return 1;
+	}
+	return 0;
+}
+
+int find_by_client(vector<lease_t> &lease, dhcp_packet *packet)
+{
+	client_key key = get_client_key(packet);
+	client_key hw_key = get_hw_key(packet);
+	int found = -1;
+	for (auto i = lease.begin(); i != lease.end(); ++i) {
+		if (key == get<0>(*i))
 			return i - lease.begin();	// returns index
+		if (found == -1 && hw_key == get<0>(*i))
+			found = i - lease.begin();	// lease (e.g. static) made for hardware address
+	}
+	return found;
+}
+
+// FNV-1a, computed once per lookup, stored in key
+static uint64_t hash_id(const u_char *id, size_t len)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= id[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// interned identifiers with reference count, node based container keeps pointers valid
+static unordered_multimap<uint64_t, pair<string, size_t>> interned;
+
+client_key find_key(const u_char *id, size_t len)
+{
+	client_key key;
+	key.hash = hash_id(id, len);
+	key.id = nullptr;
+	auto range = interned.equal_range(key.hash);
+	for (auto i = range.first; i != range.second; ++i) {
+		if (i->second.first.size() == len && memcmp(i->second.first.data(), id, len) == 0) {
+			key.id = &i->second.first;
+			break;
+		}
+	}
+	return key;
+}
+
+client_key make_key(const u_char *id, size_t len)
+{
+	client_key key = find_key(id, len);
+	if (key.id == nullptr)
+		key.id = &interned.emplace(key.hash, make_pair(string((const char *)id, len), 0))->second.first;
+	hold_key(key.id);
+	return key;
+}
+
+// node of interned identifier
+static unordered_multimap<uint64_t, pair<string, size_t>>::iterator find_interned(const string *id)
+{
+	auto range = interned.equal_range(hash_id((const u_char *)id->data(), id->size()));
+	for (auto i = range.first; i != range.second; ++i) {
+		if (&i->second.first == id)
+			return i;
+	}
+	return interned.end();
+}
+
+void hold_key(const string *id)
+{
+	auto i = find_interned(id);
+	if (i != interned.end())
+		i->second.second++;
+}
+
+void free_key(const string *id)
+{
+	auto i = find_interned(id);
+	if (i != interned.end() && --i->second.second == 0)
+		interned.erase(i);
+}
+
+size_t key_count()
+{
+	return interned.size();
+}
+
+client_key get_hw_key(dhcp_packet *packet, bool intern /*=false*/)
+{
+	u_char id[17] = {0};
+	memcpy(id + 1, packet->chaddr, 16);
+	return intern ? make_key(id, sizeof(id)) : find_key(id, sizeof(id));
+}
+
+client_key get_client_key(dhcp_packet *packet, bool intern /*=false*/)
+{
+	uint8_t len = 0;
+	u_char *data = find_option(packet, OPT_CLIENT_ID, &len);
+	if (data == nullptr || len < 2)	// type + at least one byte of identifier
+		return get_hw_key(packet, intern);
+	u_char id[256];
+	id[0] = OPT_CLIENT_ID;
+	memcpy(id + 1, data, len);
+	return intern ? make_key(id, len + 1) : find_key(id, len + 1);
+}
+
+u_char *find_option(dhcp_packet *packet, uint8_t option, uint8_t *len)
+{
+	int i = 4;	// skip magic cookie
+	while (i < OPTIONS_LENGTH) {
+		uint8_t byte = packet->options[i];
+		if (byte == 255)
+			break;
+		if (byte == 0) {	// pad
+			i++;
+			continue;
+		}
+		if (i + 1 >= OPTIONS_LENGTH || i + 2 + packet->options[i+1] > OPTIONS_LENGTH)
+			break;	// truncated option
+		if (byte == option) {
+			*len = packet->options[i+1];
+			return &packet->options[i+2];
 		}
+		i += 2 + packet->options[i+1];
 	}
-	return -1;
+	return nullptr;
 }
 
 //get 'DHCP message type'
 int get_message_type(dhcp_packet *packet)
 {
-	uint8_t byte = 0;
-	int i = 0;
-	while(byte != 255) {
-		byte = (uint8_t)packet->options[i];
-		if (byte == 53 && (uint8_t)packet->options[i+1] == 1) //if option is 'DHCP message type'
-			if ((uint8_t)packet->options[i+2] > 0 && (uint8_t)packet->options[i+2] < 8)	//message type is from interval <1,7>
-				return (uint8_t)packet->options[i+2];
-		i++;
-	}
+	uint8_t len = 0;
+	u_char *data = find_option(packet, OPT_MSG_TYPE, &len);
+	if (data != nullptr && len == 1 && data[0] > 0 && data[0] < 8)	//message type is from interval <1,7>
+		return data[0];
 	return -1; //'DHCP message type' not found
 }
 
@@ -511,26 +982,15 @@ uint32_t check_ip_addr(dhcp_packet *packet, uint32_t ip_addr, uint8_t option, ui
 {
 	//options: 54 OPT_SERVER_ID 'server identifier'
 	//		   50 OPT_REQ_IP 'requested ip address'
-	uint8_t byte = 0;
-	int i = 0;
-	int ret = 0;
-	vector<unsigned char> v;
-	while(byte != 255) {
-		byte = (uint8_t)packet->options[i];
-		if (byte == option && (uint8_t)packet->options[i+1] == 4) { //if option is 'server identiier' or 'requested ip address'
-			v = itob(ip_addr, 4);
-			reverse(v.begin(), v.end());
-			for (int j = 0; j < 4; ++j) {
-				if (v[j] != packet->options[i+j+2])
-					ret = 1;		//is not equal
-			}
-			if (ret_addr != nullptr)
-				*ret_addr = (uint32_t(packet->options[i+5]) << 24 ) | (uint32_t(packet->options[i+4]) << 16 ) | (uint32_t(packet->options[i+3]) << 8 ) | uint32_t(packet->options[i+2]);
-			return ret; // equal
-		}
-		i++;
-	}
-	return 2; //'server identifier' not found
+	uint8_t len = 0;
+	u_char *data = find_option(packet, option, &len);
+	if (data == nullptr || len != 4)
+		return 2; //'server identifier' not found
+	uint32_t found;
+	memcpy(&found, data, 4);
+	if (ret_addr != nullptr)
+		*ret_addr = found;
+	return found == ip_addr ? 0 : 1; // equal/not equal
 }
 
 // calculate broadcast, first and last usable address from network & mask
@@ -624,9 +1084,30 @@ int check_args(int argc, char **argv, addresses *addr, vector<uint32_t> &exclude
 
 void handleSignal(int signal)
 {
-	if (socket_handle != -1)
-		close(socket_handle);
-	exit(signal);
+	(void)signal;
+	stop = 1;	//main loop closes socket and prints report
+}
+
+int check_port_arg(int &argc, char **argv, int *port)
+{
+	int j = 1;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+			try {
+				*port = stoi(argv[++i]);
+			}
+			catch (...) {
+				return 1;
+			}
+			if (*port < 1 || *port > 65535)
+				return 1;
+		}
+		else
+			argv[j++] = argv[i];
+	}
+	argc = j;
+	argv[argc] = nullptr;
+	return 0;
 }
 
 void usage()
@@ -636,5 +1117,10 @@ void usage()
 		 << "Parameters" << endl
 		 << "\t-p <ip_address/mask>   IP address range" << endl
 		 << "\t-e <ip_addresses>      excluded addresses, delimited by ','" << endl
-		 << "\t-s <static_file>       file that contains static allocations" << endl;
+		 << "\t-s <static_file>       file that contains static allocations" << endl
+		 << "\t-P <host:port>         run as primary, stream leases to standby at host:port" << endl
+		 << "\t-S <port>              run as standby, receive leases from primary on port" << endl
+		 << "\t--port <port>          DHCP server port (default 67), pair of servers on one host" << endl
+		 << "\t--replay <file.pcap>   process captured requests with virtual clock instead of network" << endl
+		 << "\t-o <file.pcap>         write replies of replay to capture" << endl;
 }
\ No newline at end of file
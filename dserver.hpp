@@ -13,6 +13,11 @@
 #include <algorithm>
 #include <ctime>
 #include <fstream>
+#include <vector>
+#include <array>
+#include <tuple>
+#include <string>
+#include <unordered_map>
 
 #include <unistd.h>
 #include <sys/socket.h>
@@ -22,12 +27,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <csignal>
+#include <cerrno>
 
 #define BUFSIZE 1024 // implicit buffer size
 #define SERVER_PORT 67 // default server port
 #define CLIENT_PORT 68	// default client port
 
 #define OPTIONS_LENGTH 312
+#define DHCP_MIN_LENGTH 240 // fixed header + magic cookie
+#define MAGIC_COOKIE "\x63\x82\x53\x63"
 #define BROADCAST_BIT 32768
 
 // DHCP message types
@@ -44,8 +52,15 @@
 #define BOOTPREPLY 2
 
 // options code
+#define OPT_MSG_TYPE 53
 #define OPT_SERVER_ID 54
 #define OPT_REQ_IP 50
+#define OPT_CLIENT_ID 61
+// address pool
+#define GHOST_SIZE 1024		// remembered client -> address bindings of freed leases
+#define POOL_CANDIDATES 8	// free addresses pre-picked for new clients
+#define POOL_NONE (uint32_t)-1
+
 // lease time
 #define LEASE_TIME 120
 #define LEASE_10Y 315532800
@@ -80,14 +95,75 @@ typedef struct addresses
 
 using namespace std;
 
+// client identifier: option 61 if present, hardware address otherwise
+// ids of leases and ghosts are interned, so equal keys share one string
+// key of client without lease or ghost has no id (nullptr) and matches nothing
+typedef struct client_key
+{
+	uint64_t hash;
+	const string *id;
+	bool operator==(const client_key &other) const
+	{
+		return hash == other.hash && id == other.id && id != nullptr;
+	}
+} client_key;
+
+// (client, IP address, lease start, lease end)
+typedef tuple<client_key, uint32_t, time_t, time_t> lease_t;
+
+// free addresses of range, indexed by offset from first address
+// free list is kept in order of release, new clients get address unused for longest time
+typedef struct address_pool
+{
+	uint32_t first;		//first address of range (host byte order)
+	size_t count;		//number of free addresses
+	uint32_t head;		//least recently released free address (offset)
+	uint32_t tail;		//most recently released free address (offset)
+	vector<uint32_t> prev;
+	vector<uint32_t> next;
+	vector<char> is_free;
+	vector<const string *> owner;	//client that held free address last (ghost)
+	unordered_map<const string *, uint32_t> ghost;	//client -> its previous address
+	uint32_t ghost_head;	//oldest ghost (offset), evicted first
+	uint32_t ghost_tail;	//newest ghost (offset)
+	vector<uint32_t> ghost_prev;
+	vector<uint32_t> ghost_next;
+	vector<uint32_t> candidates;	//pre-picked addresses for new clients
+} address_pool;
+
+// replies are passed to this function instead of socket if set
+extern int (*reply_hook)(dhcp_packet *packet, struct sockaddr_in *sa);
+// time used for leases instead of system time if set (replay)
+extern time_t virtual_time;
+
 // print usage
 void usage();
+// remove --port <port> from argv, returns 1 on error
+int check_port_arg(int &argc, char **argv, int *port);
 // handle interrupt signal
 void handleSignal(int signal);
 // calculate ip addresses from network address
 void get_addresses(addresses *addr);
 // check program arguments, return excluded address list and filename of static allocations file
 int check_args(int argc, char **argv, addresses *addr, vector<uint32_t> &excluded, string &static_file);
+// load static allocations (MAC IP per line) into leases and excluded addresses
+int load_static(string &filename, vector<lease_t> &lease, vector<uint32_t> &excluded);
+// fill pool with usable addresses of network except server address and excluded ones
+void init_pool(addresses *addr, vector<uint32_t> &excluded, address_pool &pool);
+// return address to pool, client - its last holder (remembered as ghost) or nullptr
+void pool_add(address_pool &pool, uint32_t address, const string *client = nullptr);
+// remove address from pool
+void pool_take(address_pool &pool, uint32_t address);
+// address is free
+bool pool_contains(address_pool &pool, uint32_t address);
+// address for client: its previous address if still free, pre-picked candidate otherwise, POOL_NONE if pool is empty
+uint32_t pool_pick(address_pool &pool, const client_key &key);
+// pre-pick candidates for pool_pick, run between packets
+void pool_prepare(address_pool &pool);
+// free addresses in pool order
+vector<uint32_t> pool_list(address_pool &pool);
+// process one received packet of given length, returns its message type or -1 if it was dropped
+int handle_packet(int socket_handle, dhcp_packet *packet, int length, addresses *addr, address_pool &pool, vector<lease_t> &lease, uint32_t *offered_address);
 // get type of message from incoming packet (DHCPDISCOVER|DHCPREQUEST|DHCPRELEASE)
 int get_message_type(dhcp_packet *packet);
 /*check if ip address in paacket == ip_addr for OPT_REQ_IP or OPT_SERVER_ID
@@ -99,17 +175,50 @@ int get_message_type(dhcp_packet *packet);
 */
 uint32_t check_ip_addr(dhcp_packet *packet, uint32_t ip_addr, uint8_t option, uint32_t *ret_addr = nullptr);
 // send DHCPOFFER
-uint32_t offer(int socket_handle, dhcp_packet *disc_packet, addresses *addr, vector<uint32_t> &pool,  vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease);
+uint32_t offer(int socket_handle, dhcp_packet *disc_packet, addresses *addr, address_pool &pool, vector<lease_t> &lease);
 // send DHCPACK
-int ack(int socket_handle, dhcp_packet *packet, uint32_t offered_address, addresses *addr, vector<uint32_t> &pool, vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease);
+int ack(int socket_handle, dhcp_packet *packet, uint32_t offered_address, addresses *addr, address_pool &pool, vector<lease_t> &lease);
+// print row of lease table (MAC IP start end)
+void print_lease(array<u_char, 16> &client_mac, uint32_t address, time_t t_start, time_t t_end);
+// send DHCPACK if client may get the address, DHCPNAK otherwise
+int ack_or_nak(int socket_handle, dhcp_packet *packet, uint32_t address, uint32_t offered_address, addresses *addr, address_pool &pool, vector<lease_t> &lease);
 // send DHCPNAK
 int nak(int socket_handle, dhcp_packet *packet, addresses *addr);
-// find MAC address in leases
-int find_by_mac(vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease, u_char *mac);
+// current time, virtual_time if set
+time_t get_time();
+// send reply to client (or to reply_hook), on - broadcast
+int send_packet(int socket_handle, dhcp_packet *packet, struct sockaddr_in *sa, int on);
+// find option in packet, returns pointer to its data or nullptr, *len - length of data
+u_char *find_option(dhcp_packet *packet, uint8_t option, uint8_t *len);
+// key of client identifier bytes if interned, id is nullptr otherwise (never allocates)
+client_key find_key(const u_char *id, size_t len);
+// intern client identifier bytes and return its compact key, caller holds one reference
+client_key make_key(const u_char *id, size_t len);
+// take/drop reference of interned identifier, identifier is freed with its last reference
+void hold_key(const string *id);
+void free_key(const string *id);
+// number of interned identifiers
+size_t key_count();
+// key from hardware address (chaddr), intern - for new lease
+client_key get_hw_key(dhcp_packet *packet, bool intern = false);
+// key from client identifier (option 61), hardware address if option is missing, intern - for new lease
+client_key get_client_key(dhcp_packet *packet, bool intern = false);
+// find client of packet in leases, by client identifier or hardware address
+int find_by_client(vector<lease_t> &lease, dhcp_packet *packet);
+// return offered address to pool if client did not take it
+void release_offer(address_pool &pool, vector<lease_t> &lease, uint32_t offered_address);
+// lease comes from static allocations file
+bool is_static(const lease_t &l);
+/*check consistency of address pool and leases, prints violated invariant
+ *returns:
+ *	0 - ok
+ *	1 - invariant violated
+*/
+int check_leases(addresses *addr, address_pool &pool, vector<lease_t> &lease, vector<uint32_t> &excluded, uint32_t offered_address);
 // delete expired leases
-void del_expired(vector<uint32_t> &pool, vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease);
-// delete lease for certain MAC address
-int del_by_mac(vector<tuple<array<u_char, 16>, uint32_t, time_t, time_t>> &lease, vector<uint32_t> &pool, dhcp_packet *packet, int message_type);
+void del_expired(address_pool &pool, vector<lease_t> &lease);
+// delete lease of client that sent the packet, its address returns to pool unless it is keep_addr
+int del_by_client(vector<lease_t> &lease, address_pool &pool, dhcp_packet *packet, uint32_t keep_addr);
 // convert int number to vector of bytes
 vector<unsigned char> itob(size_t number, int bytes);
 
@@ -0,0 +1,318 @@
+/*
+ * File: fuzz.cpp
+ * Date: 19.10.2026
+ * Name: DHCP server, ISA project
+ * Author: agent <agent@local>
+ * Description: In-process packet harness (libFuzzer, AFL, replay)
+ */
+#include "dserver.hpp"
+
+#include <chrono>
+#include <sstream>
+
+// Input is one session: sequence of packets, each prefixed by 1 byte time delta [s] and 2 byte length (big endian).
+// Every session starts with fresh pool and leases at FUZZ_START on virtual clock, invariants are checked after every packet.
+
+#define FUZZ_NETWORK "192.168.0.0"
+#define FUZZ_CIDR 24
+#define FUZZ_EXCLUDED "192.168.0.2"
+#define FUZZ_STATIC_IP "192.168.0.99"	// static allocation of client FUZZ_STATIC
+#define FUZZ_STATIC 5
+#define FUZZ_START 1000000000	// virtual time of session start
+#define REPLAY_ROUNDS 1000
+
+static addresses addr;
+static vector<uint32_t> excluded;
+static address_pool initial_pool;
+static vector<lease_t> initial_lease;	// static allocations
+static uint64_t replies = 0;
+
+// discards lease table printed by server
+struct null_buffer : public streambuf
+{
+	int overflow(int c) { return c; }
+};
+static null_buffer null_out;
+
+static int count_reply(dhcp_packet *packet, struct sockaddr_in *sa)
+{
+	(void)packet;
+	(void)sa;
+	replies++;
+	return sizeof(dhcp_packet);
+}
+
+static void setup()
+{
+	static bool done = false;
+	if (done)
+		return;
+	done = true;
+	addr.network = inet_addr(FUZZ_NETWORK);
+	addr.mask = htonl(~(0xffffffff >> FUZZ_CIDR));
+	get_addresses(&addr);
+	excluded.push_back(inet_addr(FUZZ_EXCLUDED));
+
+	// static allocation, as load_static makes it
+	virtual_time = FUZZ_START;
+	u_char id[17] = {0x00, 0x00, 0x0b, 0x82, 0x01, 0x00, FUZZ_STATIC};
+	initial_lease.emplace_back(make_key(id, sizeof(id)), inet_addr(FUZZ_STATIC_IP), get_time(), get_time() + LEASE_10Y);
+	excluded.push_back(inet_addr(FUZZ_STATIC_IP));
+
+	init_pool(&addr, excluded, initial_pool);
+	reply_hook = count_reply;
+	cout.rdbuf(&null_out);	// do not print lease table
+}
+
+// returns number of processed packets, -1 if invariant was violated
+static long run_session(const uint8_t *data, size_t size, bool check)
+{
+	address_pool pool(initial_pool);
+	vector<lease_t> lease(initial_lease);
+	uint32_t offered_address = (uint32_t)-1;
+	dhcp_packet packet;
+	long count = 0;
+
+	for (auto i = lease.begin(); i != lease.end(); ++i)
+		hold_key(get<0>(*i).id);	// session copy holds its own references
+	virtual_time = FUZZ_START;
+
+	size_t pos = 0;
+	while (pos + 3 <= size) {
+		virtual_time += data[pos];
+		size_t len = (data[pos+1] << 8) | data[pos+2];
+		pos += 3;
+		len = min(len, size - pos);
+		size_t length = min(len, sizeof(packet));
+		memcpy(&packet, data + pos, length);
+		pos += len;
+
+		cerr.setstate(ios::badbit);	// warnings like empty pool are expected
+		handle_packet(-1, &packet, length, &addr, pool, lease, &offered_address);
+		pool_prepare(pool);
+		cerr.clear();
+		count++;
+		if (check && check_leases(&addr, pool, lease, excluded, offered_address) != 0)
+			return -1;
+	}
+
+	// drop references of leases and ghosts, nothing may stay interned between sessions
+	for (auto i = lease.begin(); i != lease.end(); ++i)
+		free_key(get<0>(*i).id);
+	for (auto i = pool.owner.begin(); i != pool.owner.end(); ++i) {
+		if (*i != nullptr)
+			free_key(*i);
+	}
+	if (check && key_count() != initial_lease.size()) {
+		cerr << "Invariant: " << key_count() << " client keys interned after session" << endl;
+		return -1;
+	}
+	return count;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	setup();
+	if (run_session(data, size, true) < 0)
+		abort();
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+// client request as sent by common DHCP clients (ISC dhclient, systemd-networkd), delay - seconds since previous packet
+static string make_packet(uint8_t type, uint16_t client, uint32_t req_ip, uint32_t server_id, uint32_t ciaddr, bool client_id, uint8_t delay = 0)
+{
+	dhcp_packet packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.op = BOOTPREQUEST;
+	packet.htype = 1;
+	packet.hlen = 6;
+	packet.xid = htonl(0x3903f326 + client);
+	packet.ciaddr = ciaddr;
+	u_char mac[6] = {0x00, 0x0b, 0x82, 0x01, (u_char)(client >> 8), (u_char)client};
+	memcpy(packet.chaddr, mac, 6);
+
+	u_char *o = packet.options;
+	memcpy(o, MAGIC_COOKIE, 4);
+	o += 4;
+	*o++ = OPT_MSG_TYPE; *o++ = 1; *o++ = type;
+	if (client_id) {
+		// DUID based identifier (RFC 4361)
+		u_char id[] = {OPT_CLIENT_ID, 15, 255, 0x5e, 0x61, 0x0b, 0x3a, 0x00, 0x02, 0x00, 0x00, 0xab, 0x11, 0x27, 0x62, (u_char)(client >> 8), (u_char)client};
+		memcpy(o, id, sizeof(id));
+		o += sizeof(id);
+	}
+	if (req_ip != 0) {
+		*o++ = OPT_REQ_IP; *o++ = 4;
+		memcpy(o, &req_ip, 4);
+		o += 4;
+	}
+	if (server_id != 0) {
+		*o++ = OPT_SERVER_ID; *o++ = 4;
+		memcpy(o, &server_id, 4);
+		o += 4;
+	}
+	if (type != DHCPRELEASE) {
+		u_char params[] = {57, 2, 0x05, 0xdc, 12, 4, 'h', 'o', 's', 't', 55, 7, 1, 3, 6, 12, 15, 28, 42};
+		memcpy(o, params, sizeof(params));
+		o += sizeof(params);
+	}
+	*o++ = 255;
+
+	size_t length = max((size_t)300, (size_t)(o - (u_char *)&packet));	// BOOTP minimum
+	string ret;
+	ret += (char)delay;
+	ret += (char)(length >> 8);
+	ret += (char)length;
+	ret.append((const char *)&packet, length);
+	return ret;
+}
+
+// sessions of DISCOVER/REQUEST/RELEASE exchanges against FUZZ_NETWORK
+static vector<string> seed_sessions()
+{
+	vector<string> sessions;
+	uint32_t server = addr.first;
+	uint32_t first = inet_addr("192.168.0.3");	// first free address of pool
+	uint32_t other = inet_addr("192.168.0.77");
+
+	// whole exchange, with and without client identifier
+	for (int cid = 0; cid < 2; ++cid) {
+		string s;
+		s += make_packet(DHCPDISCOVER, 1, 0, 0, 0, cid);
+		s += make_packet(DHCPREQUEST, 1, first, server, 0, cid);
+		s += make_packet(DHCPREQUEST, 1, 0, 0, first, cid);	// renewing
+		s += make_packet(DHCPREQUEST, 1, first, 0, 0, cid);	// init-reboot
+		s += make_packet(DHCPRELEASE, 1, 0, server, first, cid);
+		sessions.push_back(s);
+	}
+	// client requesting foreign/unknown address, request without offer
+	string s;
+	s += make_packet(DHCPREQUEST, 2, other, 0, 0, false);
+	s += make_packet(DHCPREQUEST, 2, 0, 0, other, false);
+	s += make_packet(DHCPREQUEST, 2, other, server, 0, false);
+	s += make_packet(DHCPDISCOVER, 2, 0, 0, 0, false);
+	s += make_packet(DHCPDISCOVER, 3, 0, 0, 0, false);
+	s += make_packet(DHCPREQUEST, 2, first, server, 0, false);
+	sessions.push_back(s);
+	// boot storm, more clients than addresses
+	s.clear();
+	for (int i = 0; i < 300; ++i) {
+		uint32_t ip = htonl(ntohl(first) + i);
+		s += make_packet(DHCPDISCOVER, i, 0, 0, 0, i % 2);
+		s += make_packet(DHCPREQUEST, i, ip, server, 0, i % 2);
+	}
+	for (int i = 0; i < 300; i += 3)
+		s += make_packet(DHCPRELEASE, i, 0, server, htonl(ntohl(first) + i), i % 2);
+	sessions.push_back(s);
+	// leases expire (LEASE_TIME), returning client gets ghost address, static client keeps its address
+	s.clear();
+	for (int i = 10; i < 14; ++i) {
+		uint32_t ip = htonl(ntohl(first) + i - 10);
+		s += make_packet(DHCPDISCOVER, i, 0, 0, 0, i % 2, 1);
+		s += make_packet(DHCPREQUEST, i, ip, server, 0, i % 2);
+	}
+	s += make_packet(DHCPDISCOVER, FUZZ_STATIC, 0, 0, 0, false);
+	s += make_packet(DHCPREQUEST, FUZZ_STATIC, inet_addr(FUZZ_STATIC_IP), server, 0, false);
+	s += make_packet(DHCPREQUEST, 10, 0, 0, first, false, 100);	// renewing
+	s += make_packet(DHCPDISCOVER, 20, 0, 0, 0, false, 200);	// 11-13 expired
+	s += make_packet(DHCPDISCOVER, 12, 0, 0, 0, false, 250);
+	s += make_packet(DHCPREQUEST, 12, htonl(ntohl(first) + 2), server, 0, false);
+	s += make_packet(DHCPREQUEST, FUZZ_STATIC, inet_addr(FUZZ_STATIC_IP), 0, 0, false, 250);	// init-reboot
+	sessions.push_back(s);
+	return sessions;
+}
+
+static int read_file(const char *name, string &data)
+{
+	ifstream in(name, ios::binary);
+	if (!in.good()) {
+		cerr << "Error: Cannot read " << name << endl;
+		return 1;
+	}
+	ostringstream ss;
+	ss << in.rdbuf();
+	data = ss.str();
+	return 0;
+}
+
+static void fuzz_usage()
+{
+	cerr << "Usage:" << endl
+		 << "./fuzz [file]                          run session from file or stdin (AFL)" << endl
+		 << "./fuzz -corpus <dir>                   write seed sessions to directory" << endl
+		 << "./fuzz -replay [-n rounds] [-check] [files]  replay sessions (seeds if no files), report speed" << endl;
+}
+
+int main(int argc, char **argv)
+{
+	setup();
+	if (argc == 3 && strcmp(argv[1], "-corpus") == 0) {
+		vector<string> sessions = seed_sessions();
+		for (size_t i = 0; i < sessions.size(); ++i) {
+			string name = string(argv[2]) + "/seed" + to_string(i);
+			ofstream out(name, ios::binary);
+			out << sessions[i];
+			if (!out.good()) {
+				cerr << "Error: Cannot write " << name << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		return 0;
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "-replay") == 0) {
+		long rounds = REPLAY_ROUNDS;
+		bool check = false;
+		vector<string> sessions;
+		for (int i = 2; i < argc; ++i) {
+			if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+				rounds = atol(argv[++i]);
+			else if (strcmp(argv[i], "-check") == 0)
+				check = true;
+			else {
+				sessions.emplace_back();
+				if (read_file(argv[i], sessions.back()) != 0)
+					return EXIT_FAILURE;
+			}
+		}
+		if (sessions.empty())
+			sessions = seed_sessions();
+
+		long packets = 0;
+		auto start = chrono::steady_clock::now();
+		for (long r = 0; r < rounds; ++r) {
+			for (auto i = sessions.begin(); i != sessions.end(); ++i) {
+				long n = run_session((const uint8_t *)i->data(), i->size(), check);
+				if (n < 0) {
+					cerr << "Invariant violated in session " << i - sessions.begin() << endl;
+					return EXIT_FAILURE;
+				}
+				packets += n;
+			}
+		}
+		double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cerr << "replay: packets " << packets << " replies " << replies
+			 << " seconds " << secs << " packets/s " << (secs > 0 ? packets / secs : 0) << endl;
+		return 0;
+	}
+
+	if (argc > 2) {
+		fuzz_usage();
+		return EXIT_FAILURE;
+	}
+	// AFL: one session from file or stdin, crash on violated invariant
+	string data;
+	if (argc == 2) {
+		if (read_file(argv[1], data) != 0)
+			return EXIT_FAILURE;
+	}
+	else {
+		ostringstream ss;
+		ss << cin.rdbuf();
+		data = ss.str();
+	}
+	LLVMFuzzerTestOneInput((const uint8_t *)data.data(), data.size());
+	return 0;
+}
+#endif
@@ -0,0 +1,265 @@
+/*
+ * File: replay.cpp
+ * Date: 19.10.2026
+ * Name: DHCP server, ISA project
+ * Author: agent <agent@local>
+ * Description: Replay of captured DHCP traffic from pcap file
+ */
+#include "replay.hpp"
+
+#include <chrono>
+#include <iomanip>
+
+static ifstream in;
+static ofstream out;
+static bool swapped = false;	// capture written on host with other byte order
+static bool nanos = false;		// timestamps in ns
+static uint32_t linktype = 0;
+static pcap_record current;		// input packet being processed, replies get its timestamp
+static uint32_t server_ip = 0;
+static uint64_t replies = 0;
+
+static uint32_t swap32(uint32_t v)
+{
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+static int read_record(pcap_record *rec, vector<u_char> &data)
+{
+	if (!in.read((char *)rec, sizeof(*rec)))
+		return 1;
+	rec->ts_sec = swap32(rec->ts_sec);
+	rec->ts_frac = swap32(rec->ts_frac);
+	rec->incl_len = swap32(rec->incl_len);
+	rec->orig_len = swap32(rec->orig_len);
+	if (rec->incl_len > PCAP_SNAPLEN) {
+		cerr << "Error: Invalid record in capture" << endl;
+		return 1;
+	}
+	data.resize(rec->incl_len);
+	if (!in.read((char *)data.data(), rec->incl_len)) {
+		cerr << "Warning: Truncated capture" << endl;
+		return 1;
+	}
+	return 0;
+}
+
+// find UDP payload sent to SERVER_PORT in captured frame, returns 0 if found
+static int get_payload(vector<u_char> &data, const u_char **payload, size_t *length)
+{
+	const u_char *p = data.data();
+	size_t len = data.size();
+	size_t off = 0;
+	uint16_t proto = 0;
+
+	if (linktype == LINKTYPE_ETHERNET) {
+		if (len < 14)
+			return 1;
+		proto = (p[12] << 8) | p[13];
+		off = 14;
+		while (proto == 0x8100 || proto == 0x88a8) {	// VLAN tags
+			if (len < off + 4)
+				return 1;
+			proto = (p[off+2] << 8) | p[off+3];
+			off += 4;
+		}
+	}
+	else if (linktype == LINKTYPE_RAW) {
+		proto = 0x0800;
+	}
+	else if (linktype == LINKTYPE_LINUX_SLL) {
+		if (len < 16)
+			return 1;
+		proto = (p[14] << 8) | p[15];
+		off = 16;
+	}
+	else if (linktype == LINKTYPE_LINUX_SLL2) {
+		if (len < 20)
+			return 1;
+		proto = (p[0] << 8) | p[1];
+		off = 20;
+	}
+	if (proto != 0x0800 || len < off + 20 || (p[off] >> 4) != 4)
+		return 1;
+
+	// IPv4, not fragmented UDP
+	size_t ihl = (p[off] & 0x0f) * 4;
+	size_t ip_len = (p[off+2] << 8) | p[off+3];
+	if (ihl < 20 || ip_len < ihl + 8 || off + ip_len > len || p[off+9] != IPPROTO_UDP
+		|| (((p[off+6] << 8) | p[off+7]) & 0x3fff) != 0)
+		return 1;
+	const u_char *udp = p + off + ihl;
+	size_t udp_len = (udp[4] << 8) | udp[5];
+	if (((udp[2] << 8) | udp[3]) != SERVER_PORT || udp_len < 8 || udp_len > ip_len - ihl)
+		return 1;
+	*payload = udp + 8;
+	*length = udp_len - 8;
+	return 0;
+}
+
+static uint16_t ip_checksum(const u_char *p, size_t len)
+{
+	uint32_t sum = 0;
+	for (size_t i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i+1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+// reply_hook: write reply as IPv4/UDP packet to output capture
+static int write_reply(dhcp_packet *packet, struct sockaddr_in *sa)
+{
+	replies++;
+	if (!out.is_open())
+		return sizeof(dhcp_packet);
+
+	u_char frame[20 + 8 + sizeof(dhcp_packet)];
+	size_t len = sizeof(frame);
+	memset(frame, 0, 28);
+	frame[0] = 0x45;
+	frame[2] = len >> 8;
+	frame[3] = len & 0xff;
+	frame[8] = 64;	// TTL
+	frame[9] = IPPROTO_UDP;
+	memcpy(&frame[12], &server_ip, 4);
+	memcpy(&frame[16], &sa->sin_addr.s_addr, 4);
+	uint16_t sum = ip_checksum(frame, 20);
+	frame[10] = sum >> 8;
+	frame[11] = sum & 0xff;
+	frame[20] = SERVER_PORT >> 8;
+	frame[21] = SERVER_PORT & 0xff;
+	frame[22] = ntohs(sa->sin_port) >> 8;
+	frame[23] = ntohs(sa->sin_port) & 0xff;
+	frame[24] = (len - 20) >> 8;
+	frame[25] = (len - 20) & 0xff;
+	memcpy(&frame[28], packet, sizeof(dhcp_packet));
+
+	pcap_record rec;
+	rec.ts_sec = current.ts_sec;
+	rec.ts_frac = nanos ? current.ts_frac / 1000 : current.ts_frac;
+	rec.incl_len = len;
+	rec.orig_len = len;
+	out.write((const char *)&rec, sizeof(rec));
+	out.write((const char *)frame, len);
+	return sizeof(dhcp_packet);
+}
+
+int check_replay_args(int &argc, char **argv, replay_config *cfg)
+{
+	int j = 1;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+			cfg->input = argv[++i];
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			cfg->output = argv[++i];
+		else
+			argv[j++] = argv[i];
+	}
+	argc = j;
+	argv[argc] = nullptr;
+	if (!cfg->output.empty() && cfg->input.empty())
+		return 1;	// -o without --replay
+	return 0;
+}
+
+int replay_open(replay_config *cfg)
+{
+	pcap_header hdr;
+	in.open(cfg->input, ios::binary);
+	if (!in.read((char *)&hdr, sizeof(hdr))) {
+		cerr << "Error: Cannot read capture: " << cfg->input << endl;
+		return 1;
+	}
+	swapped = hdr.magic == __builtin_bswap32(PCAP_MAGIC_US) || hdr.magic == __builtin_bswap32(PCAP_MAGIC_NS);
+	hdr.magic = swap32(hdr.magic);
+	if (hdr.magic != PCAP_MAGIC_US && hdr.magic != PCAP_MAGIC_NS) {
+		cerr << "Error: Not a pcap file: " << cfg->input << endl;
+		return 1;
+	}
+	nanos = hdr.magic == PCAP_MAGIC_NS;
+	linktype = swap32(hdr.linktype);
+	if (linktype != LINKTYPE_ETHERNET && linktype != LINKTYPE_RAW
+		&& linktype != LINKTYPE_LINUX_SLL && linktype != LINKTYPE_LINUX_SLL2) {
+		cerr << "Error: Unsupported link type " << linktype << " in capture" << endl;
+		return 1;
+	}
+
+	// clock starts at first packet, so static leases loaded before replay get deterministic times
+	pcap_record rec;
+	if (in.read((char *)&rec, sizeof(rec)))
+		virtual_time = swap32(rec.ts_sec);
+	else
+		virtual_time = 0;
+	in.clear();
+	in.seekg(sizeof(hdr));
+	return 0;
+}
+
+int replay_run(replay_config *cfg, addresses *addr, address_pool &pool, vector<lease_t> &lease)
+{
+	vector<u_char> data;
+	vector<double> times;	// [us]
+	ios::fmtflags flags = cerr.flags();	// restored after reports
+	streamsize precision = cerr.precision();
+	dhcp_packet packet;
+	uint32_t offered_address = (uint32_t)-1;
+	uint64_t frames = 0;
+
+	if (!cfg->output.empty()) {
+		pcap_header hdr;
+		hdr.magic = PCAP_MAGIC_US;
+		hdr.version_major = 2;
+		hdr.version_minor = 4;
+		hdr.thiszone = 0;
+		hdr.sigfigs = 0;
+		hdr.snaplen = PCAP_SNAPLEN;
+		hdr.linktype = LINKTYPE_RAW;
+		out.open(cfg->output, ios::binary);
+		out.write((const char *)&hdr, sizeof(hdr));
+		if (!out.good()) {
+			cerr << "Error: Cannot write capture: " << cfg->output << endl;
+			return 1;
+		}
+	}
+	server_ip = addr->first;
+	reply_hook = write_reply;
+
+	while (read_record(&current, data) == 0) {
+		const u_char *payload;
+		size_t length;
+		frames++;
+		if (get_payload(data, &payload, &length) != 0)
+			continue;
+		length = min(length, sizeof(packet));
+		memcpy(&packet, payload, length);
+		virtual_time = current.ts_sec;
+
+		auto start = chrono::steady_clock::now();
+		int type = handle_packet(-1, &packet, length, addr, pool, lease, &offered_address);
+		double us = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+		times.push_back(us);
+		pool_prepare(pool);	//between packets, as in server loop
+		cerr << "replay: packet " << times.size() << " type " << type << " time " << fixed << setprecision(3) << us << " us" << endl;
+		cerr.flags(flags);
+		cerr.precision(precision);
+	}
+	reply_hook = nullptr;
+	out.close();
+
+	if (times.empty()) {
+		cerr << "replay: frames " << frames << ", no DHCP requests" << endl;
+		return 0;
+	}
+	double total = 0;
+	for (auto i = times.begin(); i != times.end(); ++i)
+		total += *i;
+	sort(times.begin(), times.end());
+	cerr << "replay: frames " << frames << " packets " << times.size() << " replies " << replies
+		 << fixed << setprecision(3)
+		 << " total " << total << " us mean " << total / times.size()
+		 << " p50 " << times[times.size() / 2]
+		 << " p99 " << times[times.size() * 99 / 100]
+		 << " max " << times.back() << " us" << endl;
+	return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * File: replay.hpp
+ * Date: 19.10.2026
+ * Name: DHCP server, ISA project
+ * Author: agent <agent@local>
+ * Description: Replay of captured DHCP traffic from pcap file
+ */
+
+#ifndef __REPLAY_HPP
+#define __REPLAY_HPP
+
+#include "dserver.hpp"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_SNAPLEN 65535
+
+// link types
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+typedef struct pcap_header
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} __attribute__ ((packed)) pcap_header;
+
+typedef struct pcap_record
+{
+	uint32_t ts_sec;
+	uint32_t ts_frac;	// us or ns, depends on magic
+	uint32_t incl_len;
+	uint32_t orig_len;
+} __attribute__ ((packed)) pcap_record;
+
+typedef struct replay_config
+{
+	string input;	// --replay <file.pcap>
+	string output;	// -o <file.pcap>, replies
+} replay_config;
+
+// remove replay arguments (--replay <file.pcap> [-o <file.pcap>]) from argv, returns 1 on error
+int check_replay_args(int &argc, char **argv, replay_config *cfg);
+// open capture and set virtual clock to time of its first packet
+int replay_open(replay_config *cfg);
+// process all DHCP requests of capture, write replies, report processing time of every packet
+int replay_run(replay_config *cfg, addresses *addr, address_pool &pool, vector<lease_t> &lease);
+
+#endif
@@ -0,0 +1,538 @@
+/*
+ * File: sync.cpp
+ * Date: 19.10.2026
+ * Name: DHCP server, ISA project
+ * Author: agent <agent@local>
+ * Description: Lease synchronization between primary and standby dserver
+ */
+#include "sync.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+
+static sync_config config = {SYNC_NONE, "", 0};
+static mutex sync_mutex;
+static condition_variable sync_cv;
+// records are kept encoded (sync_record + client identifier)
+static vector<string> outbound;	// primary: changes waiting for sender thread
+static map<const string *, string> mirror;	// current dynamic leases by interned client id, exchanged on reconnect
+static set<const string *> own;	// standby: clients it acked itself while primary was away
+static vector<string> inbound;	// standby: received changes, primary: leases of standby to merge; waiting for packet loop
+static bool merging = false;	// primary: packet loop has not merged leases of standby yet
+static atomic<bool> peer_up(false);
+
+// statistics
+static chrono::steady_clock::time_point started;
+static atomic<uint64_t> st_batches(0);
+static atomic<uint64_t> st_records(0);
+static atomic<uint64_t> st_bytes(0);
+static atomic<uint64_t> st_connects(0);
+static atomic<uint64_t> st_lag_sum(0);	// [us]
+static atomic<uint64_t> st_lag_max(0);	// [us]
+
+static uint64_t hton64(uint64_t v)
+{
+	return ((uint64_t)htonl(v & 0xffffffff) << 32) | htonl(v >> 32);
+}
+
+static uint64_t now_us()
+{
+	return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// send/recv whole buffer, returns 0 on success
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+	char *p = (char *)buf;
+	while (len > 0) {
+		ssize_t n = recv(fd, p, len, 0);
+		if (n <= 0)
+			return 1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static string encode(uint8_t op, const string &id, uint32_t ip, time_t start, time_t end)
+{
+	sync_record rec;
+	rec.op = op;
+	rec.key_len = htons(id.size());
+	rec.ip = ip;
+	rec.start = hton64(start);
+	rec.end = hton64(end);
+	rec.stamp = hton64(now_us());
+	return string((const char *)&rec, sizeof(rec)) + id;
+}
+
+static uint8_t record_op(const string &rec)
+{
+	return ((const sync_record *)rec.data())->op;
+}
+
+// mirror record with current time, lag of resync is not measured from lease creation
+static string restamp(string rec)
+{
+	uint64_t stamp = hton64(now_us());
+	memcpy(&rec[offsetof(sync_record, stamp)], &stamp, sizeof(stamp));
+	return rec;
+}
+
+// send records as batches of at most SYNC_BATCH_MAX records
+static int send_batch(int fd, vector<string> &batch)
+{
+	string buf;
+	for (size_t i = 0; i < batch.size(); i += SYNC_BATCH_MAX) {
+		uint32_t count = min((size_t)SYNC_BATCH_MAX, batch.size() - i);
+		sync_header hdr;
+		buf.assign(sizeof(hdr), 0);
+		for (size_t j = i; j < i + count; ++j)
+			buf += batch[j];
+		hdr.magic = htonl(SYNC_MAGIC);
+		hdr.count = htonl(count);
+		hdr.length = htonl(buf.size() - sizeof(hdr));
+		memcpy(&buf[0], &hdr, sizeof(hdr));
+		if (send_all(fd, buf.data(), buf.size()) != 0)
+			return 1;
+		st_batches++;
+		st_bytes += buf.size();
+		for (size_t j = i; j < i + count; ++j) {
+			if (record_op(batch[j]) != SYNC_HELLO && record_op(batch[j]) != SYNC_ALIVE)
+				st_records++;
+		}
+	}
+	return 0;
+}
+
+// receive one batch and split it into records, returns 0 on success
+static int recv_batch(int fd, string &buf, vector<string> &batch)
+{
+	sync_header hdr;
+	batch.clear();
+	if (recv_all(fd, &hdr, sizeof(hdr)) != 0)
+		return 1;
+	uint32_t count = ntohl(hdr.count);
+	uint32_t length = ntohl(hdr.length);
+	if (ntohl(hdr.magic) != SYNC_MAGIC || count > SYNC_BATCH_MAX
+		|| length > count * (sizeof(sync_record) + SYNC_KEY_MAX)) {
+		cerr << "Error: Invalid sync batch" << endl;
+		return 1;
+	}
+	buf.resize(length);
+	if (recv_all(fd, &buf[0], length) != 0)
+		return 1;
+
+	size_t pos = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		sync_record rec;
+		if (pos + sizeof(rec) > length)
+			break;
+		memcpy(&rec, &buf[pos], sizeof(rec));
+		size_t size = sizeof(rec) + ntohs(rec.key_len);
+		if (ntohs(rec.key_len) > SYNC_KEY_MAX || pos + size > length)
+			break;
+		batch.push_back(buf.substr(pos, size));
+		pos += size;
+	}
+	if (batch.size() != count || pos != length) {
+		cerr << "Error: Invalid sync batch" << endl;
+		return 1;
+	}
+	st_batches++;
+	st_bytes += sizeof(hdr) + length;
+	return 0;
+}
+
+// dead peer must not block send/recv longer than SYNC_TIMEOUT_MS
+static void set_timeout(int fd)
+{
+	struct timeval tv = {SYNC_TIMEOUT_MS / 1000, (SYNC_TIMEOUT_MS % 1000) * 1000};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int connect_peer()
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(config.host.c_str(), to_string(config.port).c_str(), &hints, &res) != 0)
+		return -1;
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0) {
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		set_timeout(fd);
+	}
+	return fd;
+}
+
+// primary: stream queued changes to standby, resync whole table after (re)connect
+// standby first sends leases it gave during failover (all its leases if primary has just started),
+// packet loop merges them before resync
+static void sender()
+{
+	string buf;
+	vector<string> batch;
+	vector<string> table;
+	bool synced = false;	// some resync completed, lease table of primary is current
+	while (true) {
+		int fd = connect_peer();
+		if (fd < 0) {
+			this_thread::sleep_for(chrono::seconds(SYNC_RETRY_S));
+			continue;
+		}
+
+		// leases of standby, ended by SYNC_HELLO
+		batch.assign(1, encode(synced ? SYNC_HELLO : SYNC_JOIN, "", 0, 0, 0));
+		table.clear();
+		bool done = false;
+		int err = send_batch(fd, batch);
+		while (err == 0 && !done && (err = recv_batch(fd, buf, batch)) == 0) {
+			for (auto r = batch.begin(); r != batch.end(); ++r) {
+				if (record_op(*r) == SYNC_HELLO)
+					done = true;
+				else if (record_op(*r) == SYNC_ADD)
+					table.push_back(*r);
+			}
+		}
+		if (err == 0 && !table.empty()) {
+			unique_lock<mutex> lock(sync_mutex);
+			inbound.insert(inbound.end(), table.begin(), table.end());
+			merging = true;
+			sync_cv.wait(lock, []{ return !merging; });
+		}
+
+		// bulk resync, queued changes are already part of mirror
+		batch.clear();
+		if (err == 0) {
+			{
+				lock_guard<mutex> lock(sync_mutex);
+				batch.push_back(encode(SYNC_CLEAR, "", 0, 0, 0));
+				for (auto i = mirror.begin(); i != mirror.end(); ++i)
+					batch.push_back(restamp(i->second));
+				outbound.clear();
+				// standby answered SYNC_HELLO, changes after this snapshot are queued for it
+				st_connects++;
+				peer_up = true;
+			}
+			err = send_batch(fd, batch);	// packet loop must not wait for peer
+			synced = err == 0;
+		}
+		while (err == 0) {
+			batch.clear();
+			{
+				unique_lock<mutex> lock(sync_mutex);
+				sync_cv.wait_for(lock, chrono::milliseconds(SYNC_POLL_MS), []{ return !outbound.empty(); });
+				swap(batch, outbound);
+			}
+			if (batch.empty())	// heartbeat, standby drops silent connection
+				batch.push_back(encode(SYNC_ALIVE, "", 0, 0, 0));
+			err = send_batch(fd, batch);
+		}
+		close(fd);
+		if (peer_up)
+			cerr << "Warning: Lost connection to standby" << endl;
+		peer_up = false;
+		this_thread::sleep_for(chrono::seconds(SYNC_RETRY_S));	// also after failed handshake
+	}
+}
+
+// standby: accept primary and queue its records for packet loop
+// connection counts as primary only after valid SYNC_HELLO, it is dropped after SYNC_TIMEOUT_MS of silence
+static void receiver(int listen_fd)
+{
+	string buf;
+	vector<string> batch;
+	while (true) {
+		int fd = accept(listen_fd, nullptr, nullptr);
+		if (fd < 0)
+			continue;
+		set_timeout(fd);
+		if (recv_batch(fd, buf, batch) != 0 || batch.empty()
+			|| (record_op(batch[0]) != SYNC_HELLO && record_op(batch[0]) != SYNC_JOIN)) {
+			close(fd);
+			continue;
+		}
+		st_connects++;
+		peer_up = true;
+
+		// leases for primary to merge, ended by SYNC_HELLO
+		// leases copied from primary are sent only to restarted primary, which has lost them
+		vector<string> table;
+		{
+			lock_guard<mutex> lock(sync_mutex);
+			for (auto i = mirror.begin(); i != mirror.end(); ++i) {
+				if (record_op(batch[0]) == SYNC_JOIN || own.count(i->first))
+					table.push_back(i->second);
+			}
+		}
+		table.push_back(encode(SYNC_HELLO, "", 0, 0, 0));
+		if (send_batch(fd, table) != 0)
+			batch.clear();
+
+		while (!batch.empty()) {
+			uint64_t now = now_us();
+			vector<string> changes;
+			for (auto r = batch.begin(); r != batch.end(); ++r) {
+				sync_record rec;
+				memcpy(&rec, r->data(), sizeof(rec));
+				if (rec.op == SYNC_HELLO || rec.op == SYNC_JOIN || rec.op == SYNC_ALIVE)
+					continue;
+				uint64_t stamp = hton64(rec.stamp);
+				uint64_t lag = now > stamp ? now - stamp : 0;
+				st_lag_sum += lag;
+				if (lag > st_lag_max)
+					st_lag_max = lag;
+				changes.push_back(*r);
+			}
+			st_records += changes.size();
+
+			{
+				lock_guard<mutex> lock(sync_mutex);
+				inbound.insert(inbound.end(), changes.begin(), changes.end());
+			}
+			if (recv_batch(fd, buf, batch) != 0)
+				break;
+		}
+		peer_up = false;
+		close(fd);
+		cerr << "Warning: Lost connection to primary" << endl;
+	}
+}
+
+int check_sync_args(int &argc, char **argv, sync_config *cfg)
+{
+	cfg->role = SYNC_NONE;
+	int j = 1;
+	for (int i = 1; i < argc; ++i) {
+		if ((strcmp(argv[i], "-P") == 0 || strcmp(argv[i], "-S") == 0) && i + 1 < argc) {
+			if (cfg->role != SYNC_NONE)
+				return 1;
+			string arg = argv[i + 1];
+			size_t found = arg.rfind(":");
+			try {
+				if (argv[i][1] == 'P') {	// -P <host:port>
+					if (found == string::npos)
+						return 1;
+					cfg->role = SYNC_PRIMARY;
+					cfg->host = arg.substr(0, found);
+					cfg->port = stoi(arg.substr(found + 1));
+				}
+				else {	// -S <port>
+					cfg->role = SYNC_STANDBY;
+					cfg->port = stoi(arg);
+				}
+			}
+			catch (...) {
+				return 1;
+			}
+			i++;
+		}
+		else
+			argv[j++] = argv[i];
+	}
+	argc = j;
+	argv[argc] = nullptr;
+	return 0;
+}
+
+int sync_start(sync_config *cfg)
+{
+	config = *cfg;
+	started = chrono::steady_clock::now();
+	if (config.role == SYNC_PRIMARY) {
+		thread(sender).detach();
+	}
+	else if (config.role == SYNC_STANDBY) {
+		struct sockaddr_in sa;
+		int on = 1;
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			cerr << "ERR: Failed to create sync socket" << endl;
+			return 1;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = htonl(INADDR_ANY);
+		sa.sin_port = htons(config.port);
+		if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(fd, 4) < 0) {
+			cerr << "ERR: Failed to bind sync socket" << endl;
+			close(fd);
+			return 1;
+		}
+		thread(receiver, fd).detach();
+	}
+	return 0;
+}
+
+void sync_lease(uint8_t op, const client_key &key, uint32_t ip, time_t start, time_t end)
+{
+	if (config.role == SYNC_NONE)
+		return;
+	string rec = encode(op, *key.id, ip, start, end);
+
+	lock_guard<mutex> lock(sync_mutex);
+	if (op == SYNC_ADD) {
+		mirror[key.id] = rec;
+		if (config.role == SYNC_STANDBY)
+			own.insert(key.id);
+	}
+	else {
+		mirror.erase(key.id);
+		own.erase(key.id);
+	}
+	if (config.role == SYNC_PRIMARY && peer_up)
+		outbound.push_back(rec);
+	if (outbound.size() == 1)	// wake sender, changes arriving meanwhile join the batch
+		sync_cv.notify_one();
+}
+
+// primary: add lease given by standby unless it conflicts with own leases
+// returns true if new lease took reference of key
+static bool merge_lease(address_pool &pool, vector<lease_t> &lease, const client_key &key, uint32_t ip, time_t start, time_t end)
+{
+	if (end < get_time())
+		return false;
+	auto mine = lease.end();
+	for (auto i = lease.begin(); i != lease.end(); ++i) {
+		if (get<0>(*i) == key)
+			mine = i;
+		else if (get<1>(*i) == ip)
+			return false;	// leased to other client, primary wins
+	}
+	if (mine != lease.end()) {
+		if (is_static(*mine) || get<2>(*mine) >= start)
+			return false;	// own lease is newer
+		if (get<1>(*mine) != ip && !pool_contains(pool, ip))
+			return false;
+		// standby acked client later, its lease replaces own
+		pool_add(pool, get<1>(*mine), key.id);
+		sync_lease(SYNC_DEL, key, get<1>(*mine), get<2>(*mine), get<3>(*mine));
+		lease.erase(mine);
+		free_key(key.id);
+	}
+	else if (!pool_contains(pool, ip))
+		return false;	// excluded, out of range or just offered
+	pool_take(pool, ip);
+	lease.emplace_back(key, ip, start, end);
+	sync_lease(SYNC_ADD, key, ip, start, end);
+	return true;
+}
+
+void sync_apply(address_pool &pool, vector<lease_t> &lease)
+{
+	if (config.role == SYNC_NONE)
+		return;
+	vector<string> batch;
+	unique_lock<mutex> lock(sync_mutex, try_to_lock);
+	if (!lock.owns_lock() || inbound.empty())
+		return;
+	swap(batch, inbound);
+
+	if (config.role == SYNC_PRIMARY) {
+		lock.unlock();	// sync_lease takes the lock
+		for (auto r = batch.begin(); r != batch.end(); ++r) {
+			sync_record rec;
+			memcpy(&rec, r->data(), sizeof(rec));
+			client_key key = make_key((const u_char *)r->data() + sizeof(rec), r->size() - sizeof(rec));
+			if (!merge_lease(pool, lease, key, rec.ip, (time_t)hton64(rec.start), (time_t)hton64(rec.end)))
+				free_key(key.id);
+		}
+		lock.lock();
+		merging = false;
+		sync_cv.notify_all();
+		lock.unlock();
+		pool_prepare(pool);	//merged leases may have taken candidates
+		return;
+	}
+
+	// standby: mirror follows applied records, lease replaced by primary is not own anymore, lock is held
+	for (auto r = batch.begin(); r != batch.end(); ++r) {
+		sync_record rec;
+		memcpy(&rec, r->data(), sizeof(rec));
+		const u_char *id = (const u_char *)r->data() + sizeof(rec);
+		size_t len = r->size() - sizeof(rec);
+		// only new lease interns client
+		client_key key = rec.op == SYNC_ADD ? make_key(id, len) : find_key(id, len);
+		uint32_t ip = rec.ip;
+		// drop dynamic leases of this client (or all of them on resync), return addresses to pool
+		for (auto i = lease.begin(); i != lease.end(); ) {
+			if (!is_static(*i) && (rec.op == SYNC_CLEAR || get<0>(*i) == key)) {
+				pool_add(pool, get<1>(*i), get<0>(*i).id);
+				mirror.erase(get<0>(*i).id);
+				own.erase(get<0>(*i).id);
+				free_key(get<0>(*i).id);
+				i = lease.erase(i);
+			}
+			else
+				++i;
+		}
+		if (rec.op == SYNC_ADD) {
+			pool_take(pool, ip);
+			lease.emplace_back(key, ip, (time_t)hton64(rec.start), (time_t)hton64(rec.end));
+			mirror[key.id] = *r;
+		}
+	}
+	lock.unlock();
+	pool_prepare(pool);	//applied leases may have taken candidates
+}
+
+bool sync_passive()
+{
+	return config.role == SYNC_STANDBY && peer_up;
+}
+
+void sync_report(ostream &os)
+{
+	if (config.role == SYNC_NONE)
+		return;
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+	os << "sync: " << (config.role == SYNC_PRIMARY ? "primary" : "standby")
+	   << " connects " << st_connects
+	   << " batches " << st_batches
+	   << " records " << st_records
+	   << " bytes " << st_bytes
+	   << " records/s " << (secs > 0 ? st_records / secs : 0);
+	if (config.role == SYNC_STANDBY)
+		os << " avg_lag_us " << (st_records ? st_lag_sum / st_records : 0)
+		   << " max_lag_us " << st_lag_max;
+	os << endl;
+}
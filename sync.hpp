@@ -0,0 +1,83 @@
+/*
+ * File: sync.hpp
+ * Date: 19.10.2026
+ * Name: DHCP server, ISA project
+ * Author: agent <agent@local>
+ * Description: Lease synchronization between primary and standby dserver
+ */
+
+#ifndef __SYNC_HPP
+#define __SYNC_HPP
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <ctime>
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "dserver.hpp"
+
+#define SYNC_MAGIC 0x4453594e	// "DSYN"
+#define SYNC_BATCH_MAX 256		// max records in one batch
+#define SYNC_KEY_MAX 256		// max length of client identifier
+#define SYNC_POLL_MS 100		// sender thread wakeup period, heartbeat if there are no changes
+#define SYNC_TIMEOUT_MS 1000	// peer is dead after this time without batch
+#define SYNC_RETRY_S 1			// delay between reconnect attempts
+
+// sync roles
+#define SYNC_NONE 0
+#define SYNC_PRIMARY 1
+#define SYNC_STANDBY 2
+
+// record operations
+#define SYNC_ADD 1		// lease created/renewed
+#define SYNC_DEL 2		// lease released/expired
+#define SYNC_CLEAR 3	// bulk resync follows, drop all dynamic leases
+#define SYNC_HELLO 4	// first record of session (primary), end of lease table (standby reply)
+#define SYNC_ALIVE 5	// heartbeat
+#define SYNC_JOIN 6		// first record of session, primary without any completed resync wants all leases of standby
+
+// batch header, followed by 'count' records of total 'length' bytes
+typedef struct sync_header
+{
+	uint32_t magic;
+	uint32_t count;
+	uint32_t length;
+} __attribute__ ((packed)) sync_header;
+
+// one lease change followed by 'key_len' bytes of client identifier
+// multi-byte fields in network byte order (ip as in lease)
+typedef struct sync_record
+{
+	uint8_t op;
+	uint16_t key_len;
+	uint32_t ip;
+	uint64_t start;
+	uint64_t end;
+	uint64_t stamp;	// time of change on primary [us], used for lag measurement
+} __attribute__ ((packed)) sync_record;
+
+typedef struct sync_config
+{
+	int role;
+	string host;	// primary: address of standby
+	uint16_t port;	// primary: port of standby, standby: listening port
+} sync_config;
+
+// remove sync arguments (-P <host:port> | -S <port>) from argv, returns 1 on error
+int check_sync_args(int &argc, char **argv, sync_config *cfg);
+// start sync thread for given role
+int sync_start(sync_config *cfg);
+// queue lease change for peer, never blocks on network (primary only)
+void sync_lease(uint8_t op, const client_key &key, uint32_t ip, time_t start, time_t end);
+// apply received updates to lease store (standby) or merge leases of standby after reconnect (primary)
+// skipped if sync thread holds the queue
+void sync_apply(address_pool &pool, vector<lease_t> &lease);
+// standby with connected primary does not answer clients
+bool sync_passive();
+// print sync lag and throughput
+void sync_report(ostream &os);
+
+#endif
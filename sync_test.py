@@ -0,0 +1,115 @@
+#!/usr/bin/env python3
+# File: sync_test.py
+# Date: 19.10.2026
+# Name: DHCP server, ISA project
+# Author: agent <agent@local>
+# Description: Smoke test of primary/standby pair on loopback (needs port 68, run as root)
+#
+# Usage: ./sync_test.py [clients]
+
+import random
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+NETWORK = '127.0.0.0/24'
+STANDBY_PORT = 6767
+PRIMARY_PORT = 6768
+SYNC_PORT = 6700
+TIMEOUT_S = 1.5		# > SYNC_TIMEOUT_MS
+
+DISCOVER, OFFER, REQUEST, ACK = 1, 2, 3, 5
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+sock.bind(('', 68))
+sock.settimeout(1)
+
+
+def packet(mtype, client, req=None):
+	mac = bytes([0x00, 0x0b, 0x82, 0x01, client >> 8, client & 0xff])
+	opts = bytes([99, 130, 83, 99, 53, 1, mtype])
+	opts += bytes([61, 7, 1]) + mac
+	if req:	# SELECTING, server identifier is first address of network
+		opts += bytes([50, 4]) + socket.inet_aton(req)
+		opts += bytes([54, 4]) + socket.inet_aton('127.0.0.1')
+	opts += bytes([255])
+	xid = random.getrandbits(32)
+	p = struct.pack('!BBBBIHHIIII', 1, 1, 6, 0, xid, 0, 0, 0, 0, 0, 0) + mac.ljust(16, b'\0') + b'\0' * 192 + opts
+	return xid, p.ljust(300, b'\0')
+
+
+def exchange(mtype, client, port, req=None):
+	xid, p = packet(mtype, client, req)
+	sock.sendto(p, ('127.0.0.1', port))
+	while True:
+		try:
+			r = sock.recv(1024)
+		except socket.timeout:
+			return None
+		if struct.unpack('!I', r[4:8])[0] == xid:
+			return socket.inet_ntoa(r[16:20])
+
+
+# DISCOVER + REQUEST, returns acked address or None
+def lease(client, port):
+	offered = exchange(DISCOVER, client, port)
+	if offered is None:
+		return None
+	return exchange(REQUEST, client, port, offered)
+
+
+def server(port, role):
+	return subprocess.Popen(['./dserver', '-p', NETWORK, '--port', str(port)] + role,
+		stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+
+
+def stop(proc):
+	proc.send_signal(signal.SIGINT)
+	err = proc.communicate()[1]
+	return [l for l in err.splitlines() if l.startswith('sync:')]
+
+
+def check(cond, msg):
+	print(('ok   ' if cond else 'FAIL ') + msg)
+	return cond
+
+
+def main():
+	clients = int(sys.argv[1]) if len(sys.argv) > 1 else 100
+	ok = True
+	standby = server(STANDBY_PORT, ['-S', str(SYNC_PORT)])
+	time.sleep(0.5)	# listening, primary would retry connect after SYNC_RETRY_S
+	primary = server(PRIMARY_PORT, ['-P', '127.0.0.1:%d' % SYNC_PORT])
+	time.sleep(0.5)
+
+	start = time.time()
+	leases = {c: lease(c, PRIMARY_PORT) for c in range(clients)}
+	secs = time.time() - start
+	ok &= check(None not in leases.values() and len(set(leases.values())) == clients,
+		'primary leased %d addresses (%.0f exchanges/s)' % (clients, clients / secs))
+	ok &= check(exchange(DISCOVER, clients, STANDBY_PORT) is None, 'standby is silent while primary is up')
+
+	report = stop(primary)
+	time.sleep(TIMEOUT_S)
+	ok &= check(lease(0, STANDBY_PORT) == leases[0], 'standby keeps lease synced from primary')
+	failover = lease(clients, STANDBY_PORT)
+	ok &= check(failover is not None and failover not in leases.values(), 'standby leases new address after failover')
+
+	primary = server(PRIMARY_PORT, ['-P', '127.0.0.1:%d' % SYNC_PORT])
+	time.sleep(TIMEOUT_S)
+	ok &= check(exchange(DISCOVER, clients, PRIMARY_PORT) == failover, 'restarted primary learned lease of standby')
+	other = lease(clients + 1, PRIMARY_PORT)
+	ok &= check(other is not None and other != failover and other not in leases.values(), 'restarted primary does not reuse leased address')
+
+	report += stop(primary) + stop(standby)
+	for line in report:
+		print(line)
+	return 0 if ok else 1
+
+
+if __name__ == '__main__':
+	sys.exit(main())